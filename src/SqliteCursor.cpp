@@ -59,6 +59,11 @@ int SqliteCursor::next(int *pRes) {
 	return rc;
 }
 
+int SqliteCursor::previous(int *pRes) {
+	int rc = sqlite3BtreePrevious(&cursor, pRes);
+	return rc;
+}
+
 int SqliteCursor::keySize(i64 *pSize) {
 	int rc = sqlite3BtreeKeySize(&cursor, pSize);
 	return rc;
@@ -100,6 +105,14 @@ int SqliteCursor::insert(const void *pKey, i64 nKey, const void *pData, int nDat
 	return rc;
 }
 
+// Inserts a row whose data is two buffers back to back, in a single B-tree write
+int SqliteCursor::insertGather(i64 nKey, const void *pData, int nData, const void *pTail, int nTail, bool appendBias, int seekResult) {
+	gather.assign((const char *)pData, nData);
+	gather.append((const char *)pTail, nTail);
+	int rc = sqlite3BtreeInsert(&cursor, nullptr, nKey, gather.data(), (int)gather.size(), 0, appendBias, seekResult);
+	return rc;
+}
+
 int SqliteCursor::putData(u32 offset, u32 amt, const void *pData) {
 	sqlite3BtreeIncrblobCursor(&cursor);
     int rc = sqlite3BtreePutData(&cursor, offset, amt, (void *)pData);
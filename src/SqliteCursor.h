@@ -35,6 +35,7 @@ public:
 	int first(int *pRes);
 	int	last(int *pRes);
 	int next(int *pRes);
+	int previous(int *pRes);
 	int keySize(i64 *pSize);
 	int dataSize(u32 *pSize);
 	int data(u32 offset, u32 amt, void *pBuf);
@@ -42,6 +43,7 @@ public:
 	const void *keyFetch(u32 *pAmt);
 	const void *dataFetch(u32 *pAmt);
 	int insert(const void *pKey, i64 nKey, const void *pData, int nData, int nZero, bool appendBias, int seekResult);
+	int insertGather(i64 nKey, const void *pData, int nData, const void *pTail, int nTail, bool appendBias, int seekResult);
     int putData(u32 offset, u32 amt, const void *pData);
 	int deleteCurrent();
 	int deleteKey(SqliteKey *pKey);
@@ -55,6 +57,7 @@ public:
 private:
 	BtCursor cursor;
 	bool open;
+	std::string gather;
 };
 
 #endif  //_SQLITECURSOR_H
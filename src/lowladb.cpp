@@ -1,6 +1,11 @@
 #include "algorithm"
+#include "chrono"
+#include "climits"
 #include "cstdio"
+#include "functional"
 #include "set"
+#include "tuple"
+#include "unordered_map"
 
 #include "bson/bson.h"
 #include "integration.h"
@@ -43,6 +48,7 @@ static int createDatabase(const utf16string &filePath) {
 }
 
 class Tx;
+class CLowlaDBIndexImpl;
 class CLowlaDBNsCache {
 public:
     CLowlaDBNsCache();
@@ -129,13 +135,43 @@ public:
     
     std::shared_ptr<CLowlaDBCollectionImpl> createCollection(const utf16string &name);
     void collectionNames(std::vector<utf16string> *plstNames);
+    void dropCollection(const utf16string &name);
+    void renameCollection(const utf16string &from, const utf16string &to);
+    
+    std::vector<std::shared_ptr<CLowlaDBIndexImpl>> collectionIndexes(const utf16string &collName);
+    void setCollectionIndexes(const utf16string &collName, const std::vector<std::shared_ptr<CLowlaDBIndexImpl>> &indexes);
+    u32 schemaCookie();
+    struct CollectionRoots {
+        i64 headerId;
+        int collRoot;
+        int collLogRoot;
+        int lowlaIndexRoot;
+    };
+    bool collectionForHeaderId(i64 headerId, utf16string *name, CollectionRoots *roots);
+    void dropTable(int root);
+    void clearTable(int root);
+    int createSortTable();
+    void releaseSortTable(int root);
+    void dropSortTables();
+    i64 allocateRecordId(SqliteCursor *cursor, int root, int *pSeekResult);
     
     SqliteCursor::ptr openCursor(int root);
+    SqliteCursor::ptr openCursor(int root, struct KeyInfo *pKeyInfo);
     Btree *btree();
     
 private:
+    void bumpSchemaCookie();
+    const CollectionRoots *findCollection(const utf16string &name);
+    void loadCollections();
+    bool readSortTables(SqliteCursor *headerCursor, std::vector<int> *roots);
+    void writeSortTables(const std::vector<int> &roots);
+
     utf16string m_name;
     sqlite3 *m_pDb;
+    std::map<int, i64> m_nextRecordIds;
+    std::unordered_map<utf16string, CollectionRoots> m_collections;
+    bool m_collectionsLoaded;
+    u32 m_collectionsCookie;
 };
 
 class CLowlaDBWriteResultImpl {
@@ -203,18 +239,212 @@ public:
     size_t size();
     
     void finish();
+    
+private:
+    bson_type findField(bson_iterator *it, const char *key);
+    bson_type findField(bson_iterator *it, const char *key) const;
+    void buildFieldTable();
+    
+    // Offsets of the fields from the start of the data, hashed by key. The table is only built once
+    // a finished document has been searched more than once, and only by non-const lookups so that
+    // const lookups stay safe to make from several threads.
+    std::vector<uint32_t> m_fieldTable;
+    int m_lookups;
+};
+
+typedef std::vector<std::pair<std::vector<utf16string>, int>> CLowlaDBKeySpec;
+
+class CLowlaDBIndexImpl {
+public:
+    typedef std::shared_ptr<CLowlaDBIndexImpl> ptr;
+    
+    CLowlaDBIndexImpl(const char *keys, int root, bool multikey);
+    
+    int root();
+    CLowlaDBBsonImpl *keys();
+    bool hasKeys(CLowlaDBBsonImpl *keys);
+    CLowlaDBKeySpec const &parsedKeys();
+    bool isMultikey();
+    bool noteArrayKey(CLowlaDBBsonImpl *key);
+    
+    std::unique_ptr<CLowlaDBBsonImpl> createKey(CLowlaDBBsonImpl *doc);
+    void insertEntry(SqliteCursor *cursor, CLowlaDBBsonImpl *key, int64_t id);
+    void removeEntry(SqliteCursor *cursor, CLowlaDBBsonImpl *key, int64_t id);
+    
+private:
+    std::unique_ptr<CLowlaDBBsonImpl> m_keys;
+    CLowlaDBKeySpec m_parsedKeys;
+    int m_root;
+    // Some entry has held an array, so the index can't provide a sort order
+    bool m_multikey;
+};
+
+// How a cursor reaches its candidate documents. A plan depends only on the shape of the query
+// (field names and value types) and the sort, so plans are cached per collection.
+class CLowlaDBQueryPlan {
+public:
+    typedef std::shared_ptr<CLowlaDBQueryPlan> ptr;
+    
+    CLowlaDBQueryPlan();
+    
+    // Try the lowla id index first; if it misses the plan falls back to m_index or a collection scan
+    bool m_idLookup;
+    // Walk the entries of m_index whose first m_equalityFields values equal the query's
+    CLowlaDBIndexImpl::ptr m_index;
+    size_t m_equalityFields;
+    // The query also bounds the index field after the equality fields, so only that range is walked
+    bool m_rangeField;
+    // The documents arrive in sort order so no in-memory sort is needed
+    bool m_ordered;
+    bool m_reverse;
+};
+
+// A query compiled into a tree of conditions so that matching a document doesn't reparse the query.
+// Values are referenced in place so the matcher keeps the query alive.
+class CLowlaDBMatcher {
+public:
+    typedef std::shared_ptr<CLowlaDBMatcher> ptr;
+    
+    // The values a matching document may hold at a path, as far as the top level terms of the query say
+    class Bounds {
+    public:
+        Bounds();
+        
+        bool m_hasEquality;
+        bson_iterator m_equality;
+        bool m_hasLower;
+        bool m_lowerInclusive;
+        bson_iterator m_lower;
+        bool m_hasUpper;
+        bool m_upperInclusive;
+        bson_iterator m_upper;
+    };
+    
+    static CLowlaDBMatcher::ptr compile(std::shared_ptr<CLowlaDBBsonImpl> query);
+    
+    bool matches(CLowlaDBBsonImpl *doc);
+    Bounds boundsFor(std::vector<utf16string> const &path);
+    
+private:
+    enum Op { EQ, NE, GT, GTE, LT, LTE, IN, NIN, EXISTS, NOT };
+    class Condition {
+    public:
+        Op m_op;
+        bson_iterator m_value;
+        std::vector<bson_iterator> m_values;
+        bool m_valuesHaveNull;
+        bool m_exists;
+        std::vector<std::shared_ptr<Condition>> m_conditions;
+    };
+    
+    enum NodeType { AND, OR, FIELD };
+    class Node {
+    public:
+        NodeType m_type;
+        std::vector<std::shared_ptr<Node>> m_children;
+        std::vector<utf16string> m_path;
+        std::vector<std::shared_ptr<Condition>> m_conditions;
+    };
+    
+    CLowlaDBMatcher(std::shared_ptr<CLowlaDBBsonImpl> query);
+    
+    static void compileQuery(bson_iterator *it, Node *node);
+    static void compileConditions(bson_iterator *it, std::vector<std::shared_ptr<Condition>> *conditions);
+    static bool matchesNode(Node const &node, CLowlaDBBsonImpl *doc);
+    static bool matchesCondition(Condition const &condition, bool found, bson_iterator *it);
+    static void collectBounds(Node const &node, std::vector<utf16string> const &path, Bounds *bounds);
+    
+    std::shared_ptr<CLowlaDBBsonImpl> m_query;
+    Node m_root;
+};
+
+// A projection compiled into a tree of field names so that each document is filtered in a single pass.
+// A node without children selects the whole value at its path.
+class CLowlaDBProjection {
+public:
+    typedef std::shared_ptr<CLowlaDBProjection> ptr;
+    
+    static CLowlaDBProjection::ptr compile(CLowlaDBBsonImpl *keys);
+    
+    void apply(CLowlaDBBsonImpl *doc, CLowlaDBBsonImpl *answer);
+    
+private:
+    class Node {
+    public:
+        std::map<std::string, std::shared_ptr<Node>> m_children;
+    };
+    
+    CLowlaDBProjection();
+    
+    void includeFields(bson_iterator *it, Node const &node, CLowlaDBBsonImpl *answer, bool topLevel);
+    void includeValue(bson_iterator *it, Node const &node, const char *key, CLowlaDBBsonImpl *answer);
+    void excludeFields(bson_iterator *it, Node const &node, CLowlaDBBsonImpl *answer, bool topLevel);
+    void excludeValue(bson_iterator *it, Node const &node, const char *key, CLowlaDBBsonImpl *answer);
+    
+    Node m_root;
+    bool m_inclusive;
+    bool m_includeId;
+};
+
+// An update compiled into a tree of the paths it modifies, so that it can be applied to each matching
+// document in a single pass. Values are referenced in place so the update must outlive the updater.
+class CLowlaDBUpdater {
+public:
+    typedef std::shared_ptr<CLowlaDBUpdater> ptr;
+    
+    static CLowlaDBUpdater::ptr compile(CLowlaDBBsonImpl *update);
+    static bool isOperator(const char *name);
+    
+    std::unique_ptr<CLowlaDBBsonImpl> apply(CLowlaDBBsonImpl *original);
+    
+private:
+    enum Op { NONE, SET, UNSET, INC, MUL, MIN, MAX, PUSH, ADD_TO_SET, PULL, RENAME };
+    class Node {
+    public:
+        Node();
+        
+        Op m_op;
+        bson_iterator m_value;
+        // The elements that $push, $addToSet and $pull work with
+        std::vector<bson_iterator> m_values;
+        // Which rename supplies the value of a RENAME node
+        size_t m_rename;
+        // Something below this node adds a field, so missing parents have to be created
+        bool m_creates;
+        // Children are applied in the order the update lists them
+        std::vector<std::pair<std::string, std::shared_ptr<Node>>> m_children;
+        std::map<std::string, size_t> m_childIndex;
+    };
+    
+    static Op operatorFor(const char *name);
+    Node *addPath(const char *path, bool creates);
+    void addOperation(Op op, const char *opName, bson_iterator *field);
+    void applyFields(bson_iterator *it, Node const &node, CLowlaDBBsonImpl *answer, bool topLevel, bool isArray);
+    void applyValue(bson_iterator *it, const char *key, Node const &node, CLowlaDBBsonImpl *answer, bool inArray);
+    void appendMissing(const char *key, Node const &node, CLowlaDBBsonImpl *answer);
+    void appendResult(const char *key, Node const &node, bson_iterator *old, CLowlaDBBsonImpl *answer, bool inArray);
+    void appendArrayResult(const char *key, Node const &node, bson_iterator *old, CLowlaDBBsonImpl *answer);
+    bool createsValue(Node const &node);
+    
+    Node m_root;
+    std::vector<std::vector<utf16string>> m_renameSources;
+    // The values being renamed in the document that is being updated
+    std::vector<bson_iterator> m_renamed;
+    std::vector<bool> m_renameFound;
 };
 
 class CLowlaDBCollectionImpl : public std::enable_shared_from_this<CLowlaDBCollectionImpl> {
 public:
     typedef std::shared_ptr<CLowlaDBCollectionImpl> ptr;
     
-    CLowlaDBCollectionImpl(CLowlaDBImpl::ptr db, const utf16string &name, int root, int logRoot, int lowlaIndexRoot);
+    CLowlaDBCollectionImpl(CLowlaDBImpl::ptr db, const utf16string &name, CLowlaDBImpl::CollectionRoots const &roots);
     std::unique_ptr<CLowlaDBWriteResultImpl> insert(CLowlaDBBsonImpl *obj, const char *lowlaId);
     std::unique_ptr<CLowlaDBWriteResultImpl> insert(std::vector<CLowlaDBBsonImpl> &arr);
     std::unique_ptr<CLowlaDBWriteResultImpl> remove(CLowlaDBBsonImpl *query);
+    std::unique_ptr<CLowlaDBWriteResultImpl> truncate();
     std::unique_ptr<CLowlaDBWriteResultImpl> save(CLowlaDBBsonImpl *obj);
     std::unique_ptr<CLowlaDBWriteResultImpl> update(CLowlaDBBsonImpl *query, CLowlaDBBsonImpl *object, bool upsert, bool multi);
+    std::unique_ptr<CLowlaDBBsonImpl> findAndModify(CLowlaDBBsonImpl *query, CLowlaDBBsonImpl *update, CLowlaDBBsonImpl *sort, bool returnNew, bool upsert, bool remove);
     
     SqliteCursor::ptr openCursor();
     SqliteCursor::ptr openLogCursor();
@@ -227,23 +457,75 @@ public:
     
     void setWriteLog(bool writeLog);
     void updateDocument(SqliteCursor *cursor, int64_t id, CLowlaDBBsonImpl *obj, CLowlaDBBsonImpl *oldObj, CLowlaDBBsonImpl *oldMeta);
+    void deleteDocument(SqliteCursor *cursor, int64_t id, CLowlaDBBsonImpl *oldObj);
+    bool patchDocument(SqliteCursor *cursor, CLowlaDBBsonImpl *obj, CLowlaDBBsonImpl *oldObj, CLowlaDBBsonImpl *oldMeta, int *pRc);
+    
+    void ensureIndex(CLowlaDBBsonImpl *keys);
+    void dropIndex(CLowlaDBBsonImpl *keys);
+    std::vector<CLowlaDBIndexImpl::ptr> const &indexes();
+    CLowlaDBQueryPlan::ptr cachedPlan(const std::string &shape);
+    void cachePlan(const std::string &shape, CLowlaDBQueryPlan::ptr plan);
+    i64 locateLowlaId(const char *lowlaId);
+    void holdLowlaIndexCursor();
+    void releaseLowlaIndexCursor();
+    void holdIndexCursors();
+    void releaseIndexCursors();
     
     void notifyListeners();
 
 private:
     bool isReplaceObject(CLowlaDBBsonImpl *update);
-    std::unique_ptr<CLowlaDBBsonImpl> applyUpdate(CLowlaDBBsonImpl *update, CLowlaDBBsonImpl *original);
+    std::unique_ptr<CLowlaDBBsonImpl> applyUpdate(CLowlaDBBsonImpl *update, CLowlaDBUpdater *updater, CLowlaDBBsonImpl *original);
 
+    void refreshSchema();
+    SqliteCursor::ptr openLowlaIndexCursor();
     void registerLowlaId(const char *lowlaId, i64 id);
-    i64 locateLowlaId(const char *lowlaId);
+    void registerLowlaIds(std::vector<std::pair<std::string, i64>> &entries);
     void forgetLowlaId(const char *lowlaId);
+    void forgetLowlaIds(std::vector<std::string> &lowlaIds);
+    
+    SqliteCursor::ptr openIndexCursor(CLowlaDBIndexImpl *index);
+    void indexDocument(int64_t id, CLowlaDBBsonImpl *obj);
+    void reindexDocument(int64_t id, CLowlaDBBsonImpl *obj, CLowlaDBBsonImpl *oldObj);
+    void unindexDocument(int64_t id, CLowlaDBBsonImpl *oldObj);
     
     CLowlaDBImpl::ptr m_db;
+    i64 m_headerId;
     int m_root;
     int m_logRoot;
     int m_lowlaIndexRoot;
     utf16string m_name;
     bool m_writeLog;
+    
+    std::vector<CLowlaDBIndexImpl::ptr> m_indexes;
+    bool m_schemaLoaded;
+    u32 m_schemaCookie;
+    std::map<std::string, CLowlaDBQueryPlan::ptr> m_planCache;
+    SqliteCursor::ptr m_lowlaCursor;
+    int m_lowlaCursorHolds;
+    std::map<int, SqliteCursor::ptr> m_indexCursors;
+    int m_indexCursorHolds;
+};
+
+// Holds a collection's index cursors for one write call and releases them even if the call throws.
+// Call release() before committing, since no cursor may be open when the transaction ends.
+class IndexCursorHold {
+public:
+    IndexCursorHold(CLowlaDBCollectionImpl *coll) : m_coll(coll) {
+        m_coll->holdIndexCursors();
+    }
+    ~IndexCursorHold() {
+        release();
+    }
+    void release() {
+        if (m_coll) {
+            m_coll->releaseIndexCursors();
+            m_coll = nullptr;
+        }
+    }
+    
+private:
+    CLowlaDBCollectionImpl *m_coll;
 };
 
 class CLowlaDBCollectionListenerImpl
@@ -261,7 +543,9 @@ private:
     std::vector<Entry> m_listeners;
 };
 
-static std::unique_ptr<CLowlaDBImpl> lowla_db_open(const utf16string &name);
+static std::shared_ptr<CLowlaDBImpl> lowla_db_open(const utf16string &name);
+static int compareBsonFields(bson_iterator *itA, bson_iterator *itB);
+static bool isOperatorObject(bson_iterator *it);
 
 class Tx
 {
@@ -288,6 +572,7 @@ class CLowlaDBCursorImpl {
 public:
     CLowlaDBCursorImpl(CLowlaDBCollectionImpl::ptr coll, std::shared_ptr<CLowlaDBBsonImpl> query, std::shared_ptr<CLowlaDBBsonImpl> keys);
     CLowlaDBCursorImpl(const CLowlaDBCursorImpl &other);
+    ~CLowlaDBCursorImpl();
     
     std::unique_ptr<CLowlaDBCursorImpl> limit(int limit);
     std::unique_ptr<CLowlaDBCursorImpl> skip(int skip);
@@ -296,27 +581,86 @@ public:
     
     std::unique_ptr<CLowlaDBCursorImpl> showDiskLoc();
     std::unique_ptr<CLowlaDBBsonImpl> next();
+    size_t nextBatch(size_t n, std::vector<char> *buffer, std::vector<size_t> *offsets);
+    int64_t forEach(LowlaDbDocumentCallback callback, void *user);
     
     SqliteCursor::ptr sqliteCursor();
     int64_t currentId();
     std::unique_ptr<CLowlaDBBsonImpl> currentMeta();
     int64_t count();
+    std::unique_ptr<CLowlaDBBsonImpl> explain();
     
 private:
+    // Work done by the cursor, reported by explain()
+    struct Stats {
+        Stats() : entriesExamined(0), documentsExamined(0), documentsMatched(0), bytesCopied(0) {}
+        int64_t entriesExamined;
+        int64_t documentsExamined;
+        int64_t documentsMatched;
+        int64_t bytesCopied;
+    };
+    
+    // A sorted run spilled to a temporary table, with the key under its cursor
+    struct SortRun {
+        int root;
+        SqliteCursor::ptr cursor;
+        std::string key;
+    };
+    typedef std::tuple<size_t, size_t, int64_t> SortEntry;
+    
     bool matches(CLowlaDBBsonImpl *found);
+    const char *fetchCurrentDocument();
     std::unique_ptr<CLowlaDBBsonImpl> project(CLowlaDBBsonImpl *found, int64_t id);
 
-    std::unique_ptr<CLowlaDBBsonImpl> nextSorted();
-    std::unique_ptr<CLowlaDBBsonImpl> nextUnsorted();
+    bool needsProjection();
+
+    const char *nextDocument(int64_t *pId);
+    const char *nextSorted(int64_t *pId);
+    const char *nextUnsorted(int64_t *pId);
     void performSortedQuery();
+    void performTopKQuery();
+    void spillSortRun(std::string *arena, std::vector<SortEntry> *sortData);
+    bool nextSortedId(int64_t *pId);
+    bool nextMergedId(int64_t *pId);
+    void dropSortRuns();
     void parseSortSpec();
-    std::shared_ptr<CLowlaDBBsonImpl> createSortKey(CLowlaDBBsonImpl *found);
+    void appendSortKey(CLowlaDBBsonImpl *found, std::string *key);
+    
+    void openCursors();
+    void plan();
+    std::string queryShape();
+    CLowlaDBQueryPlan::ptr createPlan();
+    bool isEqualityField(std::vector<utf16string> const &path);
+    bool idEquality(bson_iterator *value);
+    bool rangeStart(bson_iterator *value, bool *pInclusive);
+    bool rangeEnd(bson_iterator *value, bool *pInclusive);
+    int checkRange(const char *entry);
+    bool providesSort(CLowlaDBKeySpec const &keys, size_t equalityFields, bool *pReverse);
+    int firstCandidate(int *pRes);
+    int nextCandidate(int *pRes);
+    int seekIndexedDocument(int rc, int *pRes);
     
     // The cursor has to come after the tx so that it is destructed (closed) before we end the tx
     CLowlaDBCollectionImpl::ptr m_coll;
     std::unique_ptr<Tx> m_tx;
     SqliteCursor::ptr m_cursor;
     SqliteCursor::ptr m_logCursor;
+    SqliteCursor::ptr m_indexCursor;
+    std::vector<SortRun> m_sortRuns;
+    std::vector<size_t> m_sortMerge;
+    
+    CLowlaDBMatcher::ptr m_matcher;
+    CLowlaDBProjection::ptr m_projection;
+    CLowlaDBQueryPlan::ptr m_plan;
+    bool m_planCached;
+    bool m_idLookupHit;
+    Stats m_stats;
+    std::unique_ptr<CLowlaDBBsonImpl> m_indexPrefix;
+    CLowlaDBMatcher::Bounds m_range;
+    bool m_rangeAscending;
+    std::vector<char> m_indexKey;
+    std::vector<char> m_scratch;
+    std::set<int64_t> m_indexSeen;
     
     std::shared_ptr<CLowlaDBBsonImpl> m_query;
     std::shared_ptr<CLowlaDBBsonImpl> m_keys;
@@ -331,6 +675,7 @@ private:
     int m_skip;
     bool m_showPending;
     bool m_showDiskLoc;
+    bool m_started;
 };
 
 CLowlaDBNsCache::CLowlaDBNsCache() : m_notifyOnClose(false)
@@ -343,6 +688,9 @@ CLowlaDBNsCache::~CLowlaDBNsCache() {
             it->second->notifyListeners();
         }
     }
+    for (coll_iterator it = m_collCache.begin() ; it != m_collCache.end() ; ++it) {
+        it->second->releaseLowlaIndexCursor();
+    }
     for (std::shared_ptr<Tx> const &tx : m_txCache) {
         tx->commit();
     }
@@ -373,6 +721,7 @@ CLowlaDBCollectionImpl *CLowlaDBNsCache::collectionForNs(const char *ns) {
     CLowlaDBImpl *db = dbIt->second.get();
     m_collCache[strNs] = db->createCollection(coll);
     it = m_collCache.find(strNs);
+    it->second->holdLowlaIndexCursor();
     return it->second.get();
 }
 
@@ -456,6 +805,10 @@ CLowlaDB::ptr CLowlaDB::create(std::shared_ptr<CLowlaDBImpl> pimpl) {
 CLowlaDB::CLowlaDB(std::shared_ptr<CLowlaDBImpl> pimpl) : m_pimpl(pimpl) {
 }
 
+std::shared_ptr<CLowlaDBImpl> CLowlaDB::pimpl() {
+    return m_pimpl;
+}
+
 class LowlaIdKey : public SqliteKey {
 public:
     static KeyInfo *getKeyInfo();
@@ -528,7 +881,70 @@ void LowlaIdKey::updateIdFromCursor(SqliteCursor *cursor) {
 	setId(id);
 }
 
-CLowlaDBImpl::CLowlaDBImpl(const utf16string &name, sqlite3 *pDb) : m_name(name), m_pDb(pDb) {
+// Keys for secondary indexes are a bson document holding the indexed values followed by a varint
+// record id. The field names in the bson record the sort direction of each value.
+class IndexKey : public SqliteKey {
+public:
+    static KeyInfo *getKeyInfo();
+    static int compare(void *pUser, int n1, const void *key1, int n2, const void *key2);
+    static bool hasPrefix(const char *key, const char *prefix);
+    static i64 idFromKey(const char *key, int cb);
+    
+    IndexKey(const char *value, i64 recordId);
+    
+    int getSize() const;
+    int writeToPointer(unsigned char *pc);
+    UnpackedRecord *newUnpackedRecord();
+	void updateIdFromCursor(SqliteCursor *cursor);
+    
+private:
+    const char *m_value;
+    int m_cb;
+};
+
+// Index keys name each value by its direction so that comparing keys needs no other context
+static const char *indexKeyName(int direction) {
+    return 1 == direction ? "1" : "-1";
+}
+
+static std::vector<utf16string> splitDottedPath(const char *path) {
+    std::vector<utf16string> answer;
+    utf16string key(path);
+    int startPos = 0;
+    int dotPos = key.indexOf('.');
+    while (-1 != dotPos) {
+        answer.push_back(key.substring(startPos, dotPos));
+        startPos = dotPos + 1;
+        dotPos = startPos < key.length() ? key.indexOf('.', startPos) : -1;
+    }
+    if (startPos < key.length()) {
+        answer.push_back(key.substring(startPos));
+    }
+    return answer;
+}
+
+// Parses a sort or index specification such as {a: 1, 'b.c': -1} into paths and directions
+static void parseKeySpec(CLowlaDBBsonImpl *spec, const char *what, CLowlaDBKeySpec *parsed)
+{
+    bson_iterator it[1];
+    bson_iterator_init(it, spec);
+    bson_type walk = bson_iterator_next(it);
+    while (BSON_EOO != walk) {
+        int sortOrder = bson_iterator_int(it);
+        if (1 != sortOrder && -1 != sortOrder) {
+            throw TeamstudioException(utf16string("Invalid ") + what + " specification: values must be +/- 1");
+        }
+        std::vector<utf16string> keys = splitDottedPath(bson_iterator_key(it));
+        if (keys.empty()) {
+            throw TeamstudioException(utf16string("Invalid ") + what + " specification: field names must not be empty");
+        }
+        parsed->push_back(std::make_pair(keys, sortOrder));
+        
+        walk = bson_iterator_next(it);
+    }
+}
+
+CLowlaDBImpl::CLowlaDBImpl(const utf16string &name, sqlite3 *pDb) : m_name(name), m_pDb(pDb), m_collectionsLoaded(false), m_collectionsCookie(0) {
 }
 
 CLowlaDBImpl::~CLowlaDBImpl() {
@@ -539,10 +955,91 @@ utf16string CLowlaDBImpl::name() {
     return m_name;
 }
 
-static std::unique_ptr<CLowlaDBImpl> lowla_db_open(const utf16string &name) {
+/* Open handles are pooled so that repeated opens, the sync code's in particular, reuse a warm page
+ * cache. A handle is only ever given to one caller at a time: Tx joins whatever transaction its
+ * connection already has, so two callers sharing a connection would commit or roll back each
+ * other's work. Concurrent opens of the same name therefore get connections of their own, just as
+ * without the pool. There is no background thread, so idle handles are closed when handles are
+ * opened or released: those idle for longer than the timeout, and the least recently used beyond
+ * the idle limit.
+ */
+static const std::chrono::seconds IDLE_DATABASE_TIMEOUT(60);
+static const size_t MAX_IDLE_DATABASES = 4;
+
+struct CPooledDb {
+    utf16string name;
+    std::shared_ptr<CLowlaDBImpl> db;
+    std::chrono::steady_clock::time_point lastUsed;
+};
+
+static sqlite3_mutex *dbPoolMutex() {
     static sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_RECURSIVE);
-    sqlite3_mutex_enter(mutex);
+    return mutex;
+}
+
+static std::vector<CPooledDb> &dbPool() {
+    static std::vector<CPooledDb> pool;
+    return pool;
+}
+
+// The pool's own reference is the only one to an idle handle. Collections keep their database alive
+// too, so a handle stays in use until they have gone as well as the caller's reference.
+static bool isIdle(CPooledDb const &pooled) {
+    return 1 == pooled.db.use_count();
+}
+
+// Must be called holding the pool mutex
+static void closeIdleDatabases(bool ignoreTimeout) {
+    std::vector<CPooledDb> &pool = dbPool();
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    pool.erase(std::remove_if(pool.begin(), pool.end(), [ignoreTimeout, now](CPooledDb const &pooled) {
+        return isIdle(pooled) && (ignoreTimeout || IDLE_DATABASE_TIMEOUT < now - pooled.lastUsed);
+    }), pool.end());
+    
+    std::vector<CPooledDb *> idle;
+    for (CPooledDb &pooled : pool) {
+        if (isIdle(pooled)) {
+            idle.push_back(&pooled);
+        }
+    }
+    if (idle.size() <= MAX_IDLE_DATABASES) {
+        return;
+    }
+    std::sort(idle.begin(), idle.end(), [](CPooledDb const *a, CPooledDb const *b) {
+        return a->lastUsed < b->lastUsed;
+    });
+    std::set<CLowlaDBImpl *> evict;
+    for (size_t i = 0 ; i < idle.size() - MAX_IDLE_DATABASES ; ++i) {
+        evict.insert(idle[i]->db.get());
+    }
+    pool.erase(std::remove_if(pool.begin(), pool.end(), [&evict](CPooledDb const &pooled) {
+        return 0 != evict.count(pooled.db.get());
+    }), pool.end());
+}
+
+// Hands a pooled handle back when the caller's last reference to it goes
+class CLowlaDBLease {
+public:
+    CLowlaDBLease(std::shared_ptr<CLowlaDBImpl> db) : m_db(db) {
+    }
     
+    ~CLowlaDBLease() {
+        sqlite3_mutex_enter(dbPoolMutex());
+        for (CPooledDb &pooled : dbPool()) {
+            if (pooled.db == m_db) {
+                pooled.lastUsed = std::chrono::steady_clock::now();
+            }
+        }
+        m_db.reset();
+        closeIdleDatabases(false);
+        sqlite3_mutex_leave(dbPoolMutex());
+    }
+    
+private:
+    std::shared_ptr<CLowlaDBImpl> m_db;
+};
+
+static std::unique_ptr<CLowlaDBImpl> lowla_db_open_file(const utf16string &name) {
     utf16string filePath = getFullPath(name);
     sqlite3 *pDb;
     int rc = sqlite3_open_v2(filePath.c_str(), &pDb, SQLITE_OPEN_READWRITE, 0);
@@ -552,9 +1049,10 @@ static std::unique_ptr<CLowlaDBImpl> lowla_db_open(const utf16string &name) {
         std::unique_ptr<CLowlaDBImpl> pimpl;
         if (SQLITE_OK == tx.rc()) {
             pimpl.reset(new CLowlaDBImpl(name, pDb));
+            // Nothing else has a cursor open yet, so this is a good time to drop leftover sort tables
+            pimpl->dropSortTables();
             tx.commit();
         }
-        sqlite3_mutex_leave(mutex);
         return pimpl;
     }
     rc = createDatabase(filePath);
@@ -563,13 +1061,42 @@ static std::unique_ptr<CLowlaDBImpl> lowla_db_open(const utf16string &name) {
     }
     if (SQLITE_OK == rc) {
         std::unique_ptr<CLowlaDBImpl> pimpl(new CLowlaDBImpl(name, pDb));
-        sqlite3_mutex_leave(mutex);
         return pimpl;
     }
-    sqlite3_mutex_leave(mutex);
     return std::unique_ptr<CLowlaDBImpl>();
 }
 
+static std::shared_ptr<CLowlaDBImpl> lowla_db_open(const utf16string &name) {
+    sqlite3_mutex_enter(dbPoolMutex());
+    
+    closeIdleDatabases(false);
+    std::vector<CPooledDb> &pool = dbPool();
+    std::shared_ptr<CLowlaDBImpl> db;
+    for (CPooledDb const &pooled : pool) {
+        if (pooled.name == name && isIdle(pooled)) {
+            db = pooled.db;
+            break;
+        }
+    }
+    if (!db) {
+        db = lowla_db_open_file(name);
+        if (db) {
+            CPooledDb pooled;
+            pooled.name = name;
+            pooled.db = db;
+            pooled.lastUsed = std::chrono::steady_clock::now();
+            pool.push_back(pooled);
+        }
+    }
+    std::shared_ptr<CLowlaDBImpl> answer;
+    if (db) {
+        // The aliasing constructor leaves the handle's shared_from_this pointing at the pool's copy
+        answer = std::shared_ptr<CLowlaDBImpl>(std::make_shared<CLowlaDBLease>(db), db.get());
+    }
+    sqlite3_mutex_leave(dbPoolMutex());
+    return answer;
+}
+
 CLowlaDB::ptr CLowlaDB::open(const utf16string &name) {
     std::shared_ptr<CLowlaDBImpl> pimpl = lowla_db_open(name);
     if (pimpl) {
@@ -587,59 +1114,31 @@ void CLowlaDB::collectionNames(std::vector<utf16string> *plstNames) {
     m_pimpl->collectionNames(plstNames);
 }
 
+void CLowlaDB::dropCollection(const utf16string &name) {
+    m_pimpl->dropCollection(name);
+}
+
+void CLowlaDB::renameCollection(const utf16string &from, const utf16string &to) {
+    m_pimpl->renameCollection(from, to);
+}
+
 std::shared_ptr<CLowlaDBCollectionImpl> CLowlaDBImpl::createCollection(const utf16string &name) {
     SqliteCursor headerCursor;
     Btree *pBt = m_pDb->aDb[0].pBt;
     
     Tx tx(pBt);
     
+    const CollectionRoots *found = findCollection(name);
+    if (found) {
+        return std::make_shared<CLowlaDBCollectionImpl>(shared_from_this(), name, *found);
+    }
+    
     const char *collName = name.c_str(utf16string::UTF8);
     
     int rc = headerCursor.create(pBt, 1, CURSOR_READWRITE, NULL);
     if (SQLITE_OK != rc) {
         return nullptr;
     }
-    int res;
-    rc = headerCursor.first(&res);
-    if (SQLITE_OK != rc) {
-        return nullptr;
-    }
-    if (!res) {
-        while (!headerCursor.isEof()) {
-            u32 wdc;
-            const void *rawData = headerCursor.dataFetch(&wdc);
-            bson data[1];
-            bson_init_finished_data(data, (char *)rawData, false);
-            bson_iterator it[1];
-            bson_type type = bson_find(it, data, "collName");
-            const char *foundName = "";
-            if (BSON_STRING == type) {
-                foundName = bson_iterator_string(it);
-            }
-            int collRoot = -1;
-            type = bson_find(it, data, "collRoot");
-            if (BSON_INT == type) {
-                collRoot = bson_iterator_int(it);
-            }
-            int collLogRoot = -1;
-            type = bson_find(it, data, "collLogRoot");
-            if (BSON_INT == type) {
-                collLogRoot = bson_iterator_int(it);
-            }
-            int lowlaIndexRoot = -1;
-            type = bson_find(it, data, "lowlaIndexRoot");
-            if (BSON_INT == type) {
-                lowlaIndexRoot = bson_iterator_int(it);
-            }
-            bson_destroy(data);
-            
-            if (0 == strcmp(collName, foundName) && -1 != collRoot && -1 != collLogRoot) {
-                headerCursor.close();
-                return std::make_shared<CLowlaDBCollectionImpl>(shared_from_this(), name, collRoot, collLogRoot, lowlaIndexRoot);
-            }
-            headerCursor.next(&res);
-        }
-    }
     int collRoot = 0;
     rc = sqlite3BtreeCreateTable(pBt, &collRoot, BTREE_INTKEY);
     if (SQLITE_OK != rc) {
@@ -665,6 +1164,7 @@ std::shared_ptr<CLowlaDBCollectionImpl> CLowlaDBImpl::createCollection(const utf
     bson_append_int(data, "lowlaIndexRoot", lowlaIndexRoot);
     bson_finish(data);
     
+    int res;
     rc = headerCursor.last(&res);
     i64 lastInternalId = 0;
     if (SQLITE_OK == rc && 0 == res) {
@@ -676,8 +1176,76 @@ std::shared_ptr<CLowlaDBCollectionImpl> CLowlaDBImpl::createCollection(const utf
     headerCursor.close();
     bson_destroy(data);
 
+    // Other handles on the file have the old collection list cached
+    bumpSchemaCookie();
     tx.commit();
-    return std::make_shared<CLowlaDBCollectionImpl>(shared_from_this(), name, collRoot, collLogRoot, lowlaIndexRoot);
+    CollectionRoots roots = { newId, collRoot, collLogRoot, lowlaIndexRoot };
+    return std::make_shared<CLowlaDBCollectionImpl>(shared_from_this(), name, roots);
+}
+
+/* Looks up a collection's root pages in a map of the header table. The map is reloaded whenever
+ * the schema cookie moves, which every change to the header table does, whichever handle made it.
+ * Must be called inside a transaction so the cookie and the header agree.
+ */
+const CLowlaDBImpl::CollectionRoots *CLowlaDBImpl::findCollection(const utf16string &name) {
+    loadCollections();
+    auto found = m_collections.find(name);
+    if (found == m_collections.end()) {
+        return nullptr;
+    }
+    return &found->second;
+}
+
+// Finds the collection whose header record is headerId. The record keeps its id when the collection
+// is renamed or its root pages move, so collection objects use it to find themselves again.
+bool CLowlaDBImpl::collectionForHeaderId(i64 headerId, utf16string *name, CollectionRoots *roots) {
+    Tx tx(btree());
+    
+    loadCollections();
+    for (auto const &walk : m_collections) {
+        if (walk.second.headerId == headerId) {
+            *name = walk.first;
+            *roots = walk.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+void CLowlaDBImpl::loadCollections() {
+    u32 cookie = schemaCookie();
+    if (m_collectionsLoaded && cookie == m_collectionsCookie) {
+        return;
+    }
+    m_collections.clear();
+    SqliteCursor headerCursor;
+    int rc = headerCursor.create(btree(), 1, CURSOR_READONLY, NULL);
+    if (SQLITE_OK != rc) {
+        return;
+    }
+    int res;
+    rc = headerCursor.first(&res);
+    while (SQLITE_OK == rc && 0 == res) {
+        u32 size;
+        headerCursor.dataSize(&size);
+        std::vector<char> data(size);
+        headerCursor.data(0, size, &data[0]);
+        CLowlaDBBsonImpl header(&data[0], CLowlaDBBsonImpl::REF);
+        const char *foundName;
+        CollectionRoots roots;
+        if (header.stringForKey("collName", &foundName) && header.intForKey("collRoot", &roots.collRoot) && header.intForKey("collLogRoot", &roots.collLogRoot)) {
+            if (!header.intForKey("lowlaIndexRoot", &roots.lowlaIndexRoot)) {
+                roots.lowlaIndexRoot = -1;
+            }
+            headerCursor.keySize(&roots.headerId);
+            // The first record wins if a name is somehow duplicated, as it always did for the scan
+            m_collections.emplace(utf16string(foundName), roots);
+        }
+        rc = headerCursor.next(&res);
+    }
+    headerCursor.close();
+    m_collectionsCookie = cookie;
+    m_collectionsLoaded = true;
 }
 
 void CLowlaDBImpl::collectionNames(std::vector<utf16string> *plstNames) {
@@ -711,21 +1279,497 @@ void CLowlaDBImpl::collectionNames(std::vector<utf16string> *plstNames) {
     headerCursor.close();
 }
 
-Btree *CLowlaDBImpl::btree() {
-    return m_pDb->aDb[0].pBt;
+// Leaves the cursor positioned on the header record for the named collection and returns a copy of it
+static std::unique_ptr<CLowlaDBBsonImpl> readCollectionHeader(SqliteCursor *headerCursor, const char *collName) {
+    int res;
+    int rc = headerCursor->first(&res);
+    while (SQLITE_OK == rc && 0 == res) {
+        u32 size;
+        headerCursor->dataSize(&size);
+        char *data = (char *)bson_malloc(size);
+        headerCursor->data(0, size, data);
+        std::unique_ptr<CLowlaDBBsonImpl> header(new CLowlaDBBsonImpl(data, CLowlaDBBsonImpl::OWN));
+        const char *foundName;
+        if (header->stringForKey("collName", &foundName) && 0 == strcmp(collName, foundName)) {
+            return header;
+        }
+        rc = headerCursor->next(&res);
+    }
+    return std::unique_ptr<CLowlaDBBsonImpl>();
 }
 
-SqliteCursor::ptr CLowlaDBImpl::openCursor(int root) {
-    SqliteCursor::ptr answer(new SqliteCursor);
-    answer->create(m_pDb->aDb[0].pBt, root, CURSOR_READWRITE, NULL);
+std::vector<CLowlaDBIndexImpl::ptr> CLowlaDBImpl::collectionIndexes(const utf16string &collName) {
+    std::vector<CLowlaDBIndexImpl::ptr> answer;
+    SqliteCursor headerCursor;
+    Btree *pBt = btree();
+    
+    Tx tx(pBt);
+    
+    int rc = headerCursor.create(pBt, 1, CURSOR_READONLY, NULL);
+    if (SQLITE_OK != rc) {
+        return answer;
+    }
+    std::unique_ptr<CLowlaDBBsonImpl> header = readCollectionHeader(&headerCursor, collName.c_str(utf16string::UTF8));
+    headerCursor.close();
+    
+    const char *indexes;
+    if (header && header->arrayForKey("indexes", &indexes)) {
+        bson_iterator it[1];
+        bson_iterator_from_buffer(it, indexes);
+        while (BSON_EOO != bson_iterator_next(it)) {
+            bson sub[1];
+            bson_iterator_subobject_init(it, sub, false);
+            CLowlaDBBsonImpl index(bson_data(sub), CLowlaDBBsonImpl::REF);
+            const char *keys;
+            int root;
+            bool multikey;
+            if (!index.boolForKey("multikey", &multikey)) {
+                multikey = false;
+            }
+            if (index.objectForKey("key", &keys) && index.intForKey("root", &root)) {
+                answer.push_back(std::make_shared<CLowlaDBIndexImpl>(keys, root, multikey));
+            }
+        }
+    }
     return answer;
 }
 
-CLowlaDBCollection::ptr CLowlaDBCollection::create(std::shared_ptr<CLowlaDBCollectionImpl> pimpl) {
-    return CLowlaDBCollection::ptr(new CLowlaDBCollection(pimpl));
+void CLowlaDBImpl::setCollectionIndexes(const utf16string &collName, const std::vector<CLowlaDBIndexImpl::ptr> &indexes) {
+    SqliteCursor headerCursor;
+    Btree *pBt = btree();
+    
+    Tx tx(pBt);
+    
+    int rc = headerCursor.create(pBt, 1, CURSOR_READWRITE, NULL);
+    if (SQLITE_OK != rc) {
+        throw TeamstudioException("Unable to open the collection header");
+    }
+    std::unique_ptr<CLowlaDBBsonImpl> header = readCollectionHeader(&headerCursor, collName.c_str(utf16string::UTF8));
+    if (!header) {
+        throw TeamstudioException("Collection not found: " + collName);
+    }
+    i64 headerId;
+    headerCursor.keySize(&headerId);
+    
+    CLowlaDBBsonImpl newHeader;
+    bson_iterator it[1];
+    bson_iterator_init(it, header.get());
+    while (BSON_EOO != bson_iterator_next(it)) {
+        if (0 != strcmp("indexes", bson_iterator_key(it))) {
+            bson_append_element(&newHeader, nullptr, it);
+        }
+    }
+    if (!indexes.empty()) {
+        newHeader.startArray("indexes");
+        for (size_t i = 0 ; i < indexes.size() ; ++i) {
+            newHeader.startObject(utf16string::valueOf((int)i).c_str());
+            newHeader.appendObject("key", indexes[i]->keys()->data());
+            newHeader.appendInt("root", indexes[i]->root());
+            if (indexes[i]->isMultikey()) {
+                newHeader.appendBool("multikey", true);
+            }
+            newHeader.finishObject();
+        }
+        newHeader.finishArray();
+    }
+    newHeader.finish();
+    
+    headerCursor.insert(NULL, headerId, newHeader.data(), (int)newHeader.size(), 0, false, 0);
+    headerCursor.close();
+    
+    bumpSchemaCookie();
+    tx.commit();
 }
 
-std::shared_ptr<CLowlaDBCollectionImpl> CLowlaDBCollection::pimpl() {
+void CLowlaDBImpl::dropCollection(const utf16string &name) {
+    SqliteCursor headerCursor;
+    Btree *pBt = btree();
+    
+    Tx tx(pBt);
+    
+    int rc = headerCursor.create(pBt, 1, CURSOR_READWRITE, NULL);
+    if (SQLITE_OK != rc) {
+        throw TeamstudioException("Unable to open the collection header");
+    }
+    std::unique_ptr<CLowlaDBBsonImpl> header = readCollectionHeader(&headerCursor, name.c_str(utf16string::UTF8));
+    if (!header) {
+        throw TeamstudioException("Collection not found: " + name);
+    }
+    std::vector<int> roots;
+    int root;
+    if (header->intForKey("collRoot", &root)) {
+        roots.push_back(root);
+    }
+    if (header->intForKey("collLogRoot", &root)) {
+        roots.push_back(root);
+    }
+    if (header->intForKey("lowlaIndexRoot", &root)) {
+        roots.push_back(root);
+    }
+    const char *indexes;
+    if (header->arrayForKey("indexes", &indexes)) {
+        bson_iterator it[1];
+        bson_iterator_from_buffer(it, indexes);
+        while (BSON_EOO != bson_iterator_next(it)) {
+            bson sub[1];
+            bson_iterator_subobject_init(it, sub, false);
+            CLowlaDBBsonImpl index(bson_data(sub), CLowlaDBBsonImpl::REF);
+            if (index.intForKey("root", &root)) {
+                roots.push_back(root);
+            }
+        }
+    }
+    rc = headerCursor.deleteCurrent();
+    headerCursor.close();
+    if (SQLITE_OK != rc) {
+        throw TeamstudioException("Unable to remove the collection header, rc=" + utf16string::valueOf(rc));
+    }
+    
+    // Under autovacuum each drop moves the highest root page into the freed one. Dropping our own
+    // roots highest first means the page that moves is never one we have still to drop, and dropTable
+    // fixes up the header records of the other collections.
+    std::sort(roots.begin(), roots.end(), std::greater<int>());
+    for (int root : roots) {
+        dropTable(root);
+    }
+    bumpSchemaCookie();
+    tx.commit();
+}
+
+void CLowlaDBImpl::renameCollection(const utf16string &from, const utf16string &to) {
+    SqliteCursor headerCursor;
+    Btree *pBt = btree();
+    
+    Tx tx(pBt);
+    
+    int rc = headerCursor.create(pBt, 1, CURSOR_READWRITE, NULL);
+    if (SQLITE_OK != rc) {
+        throw TeamstudioException("Unable to open the collection header");
+    }
+    if (readCollectionHeader(&headerCursor, to.c_str(utf16string::UTF8))) {
+        throw TeamstudioException("Collection already exists: " + to);
+    }
+    std::unique_ptr<CLowlaDBBsonImpl> header = readCollectionHeader(&headerCursor, from.c_str(utf16string::UTF8));
+    if (!header) {
+        throw TeamstudioException("Collection not found: " + from);
+    }
+    i64 headerId;
+    headerCursor.keySize(&headerId);
+    
+    CLowlaDBBsonImpl newHeader;
+    bson_iterator it[1];
+    bson_iterator_init(it, header.get());
+    while (BSON_EOO != bson_iterator_next(it)) {
+        if (0 == strcmp("collName", bson_iterator_key(it))) {
+            newHeader.appendString("collName", to.c_str(utf16string::UTF8));
+        }
+        else {
+            bson_append_element(&newHeader, nullptr, it);
+        }
+    }
+    newHeader.finish();
+    
+    headerCursor.insert(NULL, headerId, newHeader.data(), (int)newHeader.size(), 0, false, 0);
+    headerCursor.close();
+    
+    bumpSchemaCookie();
+    tx.commit();
+}
+
+// The schema cookie changes whenever the header table changes so that collection objects
+// (possibly belonging to other handles on the same file) know to reload their metadata.
+u32 CLowlaDBImpl::schemaCookie() {
+    u32 answer = 0;
+    sqlite3BtreeGetMeta(btree(), BTREE_SCHEMA_VERSION, &answer);
+    return answer;
+}
+
+void CLowlaDBImpl::bumpSchemaCookie() {
+    sqlite3BtreeUpdateMeta(btree(), BTREE_SCHEMA_VERSION, schemaCookie() + 1);
+}
+
+static bool isRootField(const char *key) {
+    return 0 == strcmp("collRoot", key) || 0 == strcmp("collLogRoot", key) || 0 == strcmp("lowlaIndexRoot", key) || 0 == strcmp("root", key);
+}
+
+// Copies the header fields into out, replacing any root page number equal to from with to
+static bool copyRelocatingRoot(bson *out, bson_iterator *it, int from, int to) {
+    bool answer = false;
+    while (BSON_EOO != bson_iterator_next(it)) {
+        const char *key = bson_iterator_key(it);
+        bson_type type = bson_iterator_type(it);
+        if (BSON_INT == type && from == bson_iterator_int(it) && isRootField(key)) {
+            bson_append_int(out, key, to);
+            answer = true;
+        }
+        else if (BSON_OBJECT == type || BSON_ARRAY == type) {
+            bson_iterator sub[1];
+            bson_iterator_subiterator(it, sub);
+            if (BSON_OBJECT == type) {
+                bson_append_start_object(out, key);
+            }
+            else {
+                bson_append_start_array(out, key);
+            }
+            answer = copyRelocatingRoot(out, sub, from, to) || answer;
+            bson_append_finish_object(out);
+        }
+        else {
+            bson_append_element(out, nullptr, it);
+        }
+    }
+    return answer;
+}
+
+// Empties a table by freeing its pages rather than deleting its rows one by one
+void CLowlaDBImpl::clearTable(int root) {
+    int rc = sqlite3BtreeClearTable(btree(), root, nullptr);
+    if (SQLITE_OK != rc) {
+        throw TeamstudioException("Unable to clear table, rc=" + utf16string::valueOf(rc));
+    }
+}
+
+void CLowlaDBImpl::dropTable(int root) {
+    Btree *pBt = btree();
+    
+    Tx tx(pBt);
+    
+    int moved = 0;
+    int rc = sqlite3BtreeDropTable(pBt, root, &moved);
+    if (SQLITE_OK != rc) {
+        throw TeamstudioException("Unable to drop table, rc=" + utf16string::valueOf(rc));
+    }
+    // With autovacuum sqlite keeps the root pages together by moving the last root page into the
+    // one we just freed, so any header record referring to the moved page must follow it.
+    if (0 != moved) {
+        SqliteCursor headerCursor;
+        headerCursor.create(pBt, 1, CURSOR_READWRITE, NULL);
+        int res;
+        rc = headerCursor.first(&res);
+        while (SQLITE_OK == rc && 0 == res) {
+            u32 size;
+            headerCursor.dataSize(&size);
+            std::vector<char> data(size);
+            headerCursor.data(0, size, &data[0]);
+            bson_iterator it[1];
+            bson_iterator_from_buffer(it, &data[0]);
+            CLowlaDBBsonImpl newHeader;
+            if (copyRelocatingRoot(&newHeader, it, moved, root)) {
+                newHeader.finish();
+                i64 headerId;
+                headerCursor.keySize(&headerId);
+                headerCursor.insert(NULL, headerId, newHeader.data(), (int)newHeader.size(), 0, false, 0);
+                headerCursor.movetoUnpacked(nullptr, headerId, 0, &res);
+            }
+            rc = headerCursor.next(&res);
+        }
+        headerCursor.close();
+    }
+    m_nextRecordIds.clear();
+    bumpSchemaCookie();
+    tx.commit();
+}
+
+/* Sort tables that could not be dropped straight away are listed in a header record of their own,
+ * {sortTables: [{root: n}, ...]}. Keeping the list in the file means it commits or rolls back along
+ * with the tables themselves, and dropTable relocates its roots like any other.
+ */
+bool CLowlaDBImpl::readSortTables(SqliteCursor *headerCursor, std::vector<int> *roots) {
+    int res;
+    int rc = headerCursor->first(&res);
+    while (SQLITE_OK == rc && 0 == res) {
+        u32 size;
+        headerCursor->dataSize(&size);
+        std::vector<char> data(size);
+        headerCursor->data(0, size, &data[0]);
+        CLowlaDBBsonImpl header(&data[0], CLowlaDBBsonImpl::REF);
+        const char *tables;
+        if (header.arrayForKey("sortTables", &tables)) {
+            bson_iterator it[1];
+            bson_iterator_from_buffer(it, tables);
+            while (BSON_EOO != bson_iterator_next(it)) {
+                bson sub[1];
+                bson_iterator_subobject_init(it, sub, false);
+                CLowlaDBBsonImpl table(bson_data(sub), CLowlaDBBsonImpl::REF);
+                int root;
+                if (table.intForKey("root", &root)) {
+                    roots->push_back(root);
+                }
+            }
+            return true;
+        }
+        rc = headerCursor->next(&res);
+    }
+    return false;
+}
+
+void CLowlaDBImpl::writeSortTables(const std::vector<int> &roots) {
+    SqliteCursor headerCursor;
+    int rc = headerCursor.create(btree(), 1, CURSOR_READWRITE, NULL);
+    if (SQLITE_OK != rc) {
+        throw TeamstudioException("Unable to open the collection header");
+    }
+    std::vector<int> oldRoots;
+    int res;
+    i64 headerId = 0;
+    if (readSortTables(&headerCursor, &oldRoots)) {
+        headerCursor.keySize(&headerId);
+        if (roots.empty()) {
+            headerCursor.deleteCurrent();
+            headerCursor.close();
+            return;
+        }
+    }
+    else if (roots.empty()) {
+        headerCursor.close();
+        return;
+    }
+    else {
+        rc = headerCursor.last(&res);
+        if (SQLITE_OK == rc && 0 == res) {
+            headerCursor.keySize(&headerId);
+        }
+        ++headerId;
+    }
+    CLowlaDBBsonImpl record;
+    record.startArray("sortTables");
+    for (size_t i = 0 ; i < roots.size() ; ++i) {
+        record.startObject(utf16string::valueOf((int)i).c_str());
+        record.appendInt("root", roots[i]);
+        record.finishObject();
+    }
+    record.finishArray();
+    record.finish();
+    headerCursor.insert(NULL, headerId, record.data(), (int)record.size(), 0, false, 0);
+    headerCursor.close();
+}
+
+// Returns an empty table for a sort run, reusing one that is waiting to be dropped if there is one
+int CLowlaDBImpl::createSortTable() {
+    Tx tx(btree());
+    
+    std::vector<int> roots;
+    SqliteCursor headerCursor;
+    if (SQLITE_OK == headerCursor.create(btree(), 1, CURSOR_READONLY, NULL)) {
+        readSortTables(&headerCursor, &roots);
+        headerCursor.close();
+    }
+    int root = 0;
+    if (!roots.empty()) {
+        root = roots.back();
+        roots.pop_back();
+        writeSortTables(roots);
+        clearTable(root);
+    }
+    else {
+        int rc = sqlite3BtreeCreateTable(btree(), &root, BTREE_BLOBKEY);
+        if (SQLITE_OK != rc) {
+            throw TeamstudioException("Unable to create sort table, rc=" + utf16string::valueOf(rc));
+        }
+    }
+    tx.commit();
+    return root;
+}
+
+// Sort tables can only be dropped while no cursors are open, so those that can't be dropped yet
+// are emptied and kept for later sorts or a later attempt
+void CLowlaDBImpl::releaseSortTable(int root) {
+    Tx tx(btree());
+    
+    clearTable(root);
+    std::vector<int> roots;
+    SqliteCursor headerCursor;
+    if (SQLITE_OK == headerCursor.create(btree(), 1, CURSOR_READONLY, NULL)) {
+        readSortTables(&headerCursor, &roots);
+        headerCursor.close();
+    }
+    roots.push_back(root);
+    writeSortTables(roots);
+    dropSortTables();
+    tx.commit();
+}
+
+void CLowlaDBImpl::dropSortTables() {
+    Tx tx(btree());
+    
+    for (;;) {
+        std::vector<int> roots;
+        SqliteCursor headerCursor;
+        if (SQLITE_OK != headerCursor.create(btree(), 1, CURSOR_READONLY, NULL)) {
+            break;
+        }
+        readSortTables(&headerCursor, &roots);
+        headerCursor.close();
+        if (roots.empty()) {
+            break;
+        }
+        // Highest first, so that an autovacuum move never relocates a root still in the list
+        auto highest = std::max_element(roots.begin(), roots.end());
+        int root = *highest;
+        try {
+            dropTable(root);
+        }
+        catch (TeamstudioException const &) {
+            // Cursors are still open; try again next time
+            break;
+        }
+        // dropTable may have moved another root into the one just freed, so reread the list
+        roots.clear();
+        headerCursor.create(btree(), 1, CURSOR_READONLY, NULL);
+        readSortTables(&headerCursor, &roots);
+        headerCursor.close();
+        auto dropped = std::find(roots.begin(), roots.end(), root);
+        if (dropped != roots.end()) {
+            roots.erase(dropped);
+        }
+        writeSortTables(roots);
+    }
+    tx.commit();
+}
+
+/* Returns the record id for a new row in the table at root and leaves the cursor positioned for the
+ * insert, with the seek result to pass to it. Ids come from a per-table counter seeded from the end
+ * of the table. Another connection may have written the table since, so the counter is only trusted
+ * while seeking to it lands past the last row; otherwise it is reseeded.
+ */
+i64 CLowlaDBImpl::allocateRecordId(SqliteCursor *cursor, int root, int *pSeekResult) {
+    i64 &next = m_nextRecordIds[root];
+    int res = 0;
+    if (0 != next && SQLITE_OK == cursor->movetoUnpacked(nullptr, next, 0, &res) && res < 0) {
+        *pSeekResult = res;
+        return next++;
+    }
+    i64 lastInternalId = 0;
+    int rc = cursor->last(&res);
+    if (SQLITE_OK == rc && 0 == res) {
+        rc = cursor->keySize(&lastInternalId);
+    }
+    next = lastInternalId + 1;
+    *pSeekResult = -1;
+    return next++;
+}
+
+Btree *CLowlaDBImpl::btree() {
+    return m_pDb->aDb[0].pBt;
+}
+
+SqliteCursor::ptr CLowlaDBImpl::openCursor(int root) {
+    SqliteCursor::ptr answer(new SqliteCursor);
+    answer->create(m_pDb->aDb[0].pBt, root, CURSOR_READWRITE, NULL);
+    return answer;
+}
+
+SqliteCursor::ptr CLowlaDBImpl::openCursor(int root, struct KeyInfo *pKeyInfo) {
+    SqliteCursor::ptr answer(new SqliteCursor);
+    answer->create(m_pDb->aDb[0].pBt, root, CURSOR_READWRITE, pKeyInfo);
+    return answer;
+}
+
+CLowlaDBCollection::ptr CLowlaDBCollection::create(std::shared_ptr<CLowlaDBCollectionImpl> pimpl) {
+    return CLowlaDBCollection::ptr(new CLowlaDBCollection(pimpl));
+}
+
+std::shared_ptr<CLowlaDBCollectionImpl> CLowlaDBCollection::pimpl() {
     return m_pimpl;
 }
 
@@ -776,6 +1820,36 @@ CLowlaDBWriteResult::ptr CLowlaDBCollection::update(const char *queryBson, const
     return CLowlaDBWriteResult::create(pimpl);
 }
 
+CLowlaDBBson::ptr CLowlaDBCollection::findAndModify(const char *queryBson, const char *updateBson, const char *sortBson, bool returnNew, bool upsert, bool remove) {
+    std::unique_ptr<CLowlaDBBsonImpl> query;
+    std::unique_ptr<CLowlaDBBsonImpl> update;
+    std::unique_ptr<CLowlaDBBsonImpl> sort;
+    if (queryBson) {
+        query.reset(new CLowlaDBBsonImpl(queryBson, CLowlaDBBsonImpl::REF));
+    }
+    if (updateBson) {
+        update.reset(new CLowlaDBBsonImpl(updateBson, CLowlaDBBsonImpl::REF));
+    }
+    if (sortBson) {
+        sort.reset(new CLowlaDBBsonImpl(sortBson, CLowlaDBBsonImpl::REF));
+    }
+    std::shared_ptr<CLowlaDBBsonImpl> answer = m_pimpl->findAndModify(query.get(), update.get(), sort.get(), returnNew, upsert, remove);
+    if (!answer) {
+        return CLowlaDBBson::ptr();
+    }
+    return CLowlaDBBson::create(answer);
+}
+
+void CLowlaDBCollection::ensureIndex(const char *keysBson) {
+    CLowlaDBBsonImpl keys(keysBson, CLowlaDBBsonImpl::REF);
+    m_pimpl->ensureIndex(&keys);
+}
+
+void CLowlaDBCollection::dropIndex(const char *keysBson) {
+    CLowlaDBBsonImpl keys(keysBson, CLowlaDBBsonImpl::REF);
+    m_pimpl->dropIndex(&keys);
+}
+
 static utf16string generateLowlaId(CLowlaDBCollectionImpl *coll, CLowlaDBBsonImpl *obj) {
     const char *id;
     bson_oid_t oid;
@@ -793,7 +1867,7 @@ static utf16string generateLowlaId(CLowlaDBCollectionImpl *coll, CLowlaDBBsonImp
     }
 }
 
-CLowlaDBCollectionImpl::CLowlaDBCollectionImpl(CLowlaDBImpl::ptr db, const utf16string &name, int root, int logRoot, int lowlaIndexRoot) : m_db(db), m_name(name), m_root(root), m_logRoot(logRoot), m_lowlaIndexRoot(lowlaIndexRoot), m_writeLog(true) {
+CLowlaDBCollectionImpl::CLowlaDBCollectionImpl(CLowlaDBImpl::ptr db, const utf16string &name, CLowlaDBImpl::CollectionRoots const &roots) : m_db(db), m_headerId(roots.headerId), m_root(roots.collRoot), m_logRoot(roots.collLogRoot), m_lowlaIndexRoot(roots.lowlaIndexRoot), m_name(name), m_writeLog(true), m_schemaLoaded(false), m_schemaCookie(0), m_lowlaCursorHolds(0), m_indexCursorHolds(0) {
 }
 
 static void throwIfDocumentInvalidForInsertion(bson const *obj) {
@@ -828,7 +1902,7 @@ static void throwIfDocumentInvalidForUpdate(bson const *obj) {
                 bson_iterator_subobject_init(it, sub, false);
                 throwIfDocumentInvalidForInsertion(sub);
             }
-            else if (0 == strcmp("$unset", key)) {
+            else if (CLowlaDBUpdater::isOperator(key)) {
             }
             else {
                 utf16string msg("The dollar ($) prefixed field ");
@@ -863,14 +1937,7 @@ std::unique_ptr<CLowlaDBWriteResultImpl> CLowlaDBCollectionImpl::insert(CLowlaDB
     
     Tx tx(m_db->btree());
     
-    SqliteCursor::ptr cursor = m_db->openCursor(m_root);
-    int res = 0;
-    int rc = cursor->last(&res);
-    i64 lastInternalId = 0;
-    if (SQLITE_OK == rc && 0 == res) {
-        rc = cursor->keySize(&lastInternalId);
-    }
-    i64 newId = lastInternalId + 1;
+    SqliteCursor::ptr cursor = openCursor();
     CLowlaDBBsonImpl meta;
     if (nullptr != lowlaId) {
         meta.appendString("id", lowlaId);
@@ -880,18 +1947,17 @@ std::unique_ptr<CLowlaDBWriteResultImpl> CLowlaDBCollectionImpl::insert(CLowlaDB
     }
     meta.finish();
     meta.stringForKey("id", &lowlaId);
-    rc = cursor->insert(NULL, newId, obj->data(), (int)obj->size(), (int)meta.size(), true, 0);
+    int seekResult;
+    i64 newId = m_db->allocateRecordId(cursor.get(), m_root, &seekResult);
+    int rc = cursor->insertGather(newId, obj->data(), (int)obj->size(), meta.data(), (int)meta.size(), true, seekResult);
     if (SQLITE_OK == rc) {
-        rc = cursor->movetoUnpacked(nullptr, newId, 0, &res);
-        cursor->putData((int)obj->size(), (int)meta.size(), meta.data());
         if (m_writeLog) {
-            SqliteCursor::ptr logCursor = m_db->openCursor(m_logRoot);
+            SqliteCursor::ptr logCursor = openLogCursor();
             static char logData[] = {5, 0, 0, 0, 0};
-            rc = logCursor->insert(NULL, newId, logData, sizeof(logData), (int)meta.size(), true, 0);
-            logCursor->movetoUnpacked(nullptr, newId, 0, &res);
-            logCursor->putData(sizeof(logData), (int)meta.size(), meta.data());
+            rc = logCursor->insertGather(newId, logData, sizeof(logData), meta.data(), (int)meta.size(), true, 0);
         }
         registerLowlaId(lowlaId, newId);
+        indexDocument(newId, obj);
     }
     if (obj->ownsData) {
         obj->ownsData = false;
@@ -923,8 +1989,11 @@ std::unique_ptr<CLowlaDBWriteResultImpl> CLowlaDBCollectionImpl::insert(std::vec
     std::unique_ptr<CLowlaDBWriteResultImpl> answer(new CLowlaDBWriteResultImpl);
     
     Tx tx(m_db->btree());
-    SqliteCursor::ptr cursor = m_db->openCursor(m_root);
-    SqliteCursor::ptr logCursor = m_db->openCursor(m_logRoot);
+    SqliteCursor::ptr cursor = openCursor();
+    SqliteCursor::ptr logCursor = openLogCursor();
+    IndexCursorHold indexCursors(this);
+    std::vector<std::pair<std::string, i64>> lowlaIds;
+    lowlaIds.reserve(arr.size());
 
     for (size_t i = 0 ; i < arr.size() ; ++i) {
         CLowlaDBBsonImpl *obj = &arr[i];
@@ -938,29 +2007,21 @@ std::unique_ptr<CLowlaDBWriteResultImpl> CLowlaDBCollectionImpl::insert(std::vec
             obj = &fixed;
         }
     
-        int res = 0;
-        int rc = cursor->last(&res);
-        i64 lastInternalId = 0;
-        if (SQLITE_OK == rc && 0 == res) {
-            rc = cursor->keySize(&lastInternalId);
-        }
-        i64 newId = lastInternalId + 1;
         CLowlaDBBsonImpl meta;
         meta.appendString("id", generateLowlaId(this, obj).c_str());
         meta.finish();
         const char *lowlaId;
         meta.stringForKey("id", &lowlaId);
-        rc = cursor->insert(NULL, newId, obj->data(), (int)obj->size(), (int)meta.size(), true, 0);
+        int seekResult;
+        i64 newId = m_db->allocateRecordId(cursor.get(), m_root, &seekResult);
+        int rc = cursor->insertGather(newId, obj->data(), (int)obj->size(), meta.data(), (int)meta.size(), true, seekResult);
         if (SQLITE_OK == rc) {
-            rc = cursor->movetoUnpacked(nullptr, newId, 0, &res);
-            cursor->putData((int)obj->size(), (int)meta.size(), meta.data());
             static char logData[] = {5, 0, 0, 0, 0};
             if (m_writeLog) {
-                rc = logCursor->insert(NULL, newId, logData, sizeof(logData), (int)meta.size(), true, 0);
-                logCursor->movetoUnpacked(nullptr, newId, 0, &res);
-                logCursor->putData(sizeof(logData), (int)meta.size(), meta.data());
+                rc = logCursor->insertGather(newId, logData, sizeof(logData), meta.data(), (int)meta.size(), true, 0);
             }
-            registerLowlaId(lowlaId, newId);
+            lowlaIds.push_back(std::make_pair(std::string(lowlaId), newId));
+            indexDocument(newId, obj);
         }
         if (obj->ownsData) {
             obj->ownsData = false;
@@ -971,8 +2032,10 @@ std::unique_ptr<CLowlaDBWriteResultImpl> CLowlaDBCollectionImpl::insert(std::vec
         }
     }
     
+    indexCursors.release();
     logCursor->close();
     cursor->close();
+    registerLowlaIds(lowlaIds);
     
     notifyListeners();
     
@@ -982,6 +2045,10 @@ std::unique_ptr<CLowlaDBWriteResultImpl> CLowlaDBCollectionImpl::insert(std::vec
 }
 
 std::unique_ptr<CLowlaDBWriteResultImpl> CLowlaDBCollectionImpl::remove(CLowlaDBBsonImpl *query) {
+    if (nullptr == query || query->isEmpty()) {
+        return truncate();
+    }
+    
     Tx tx(m_db->btree());
     
     // The cursor needs a shared_ptr so we create a new ClowlaDBBsonImpl using the incoming data
@@ -992,36 +2059,86 @@ std::unique_ptr<CLowlaDBWriteResultImpl> CLowlaDBCollectionImpl::remove(CLowlaDB
     
     auto cursor = std::make_shared<CLowlaDBCursorImpl>(shared_from_this(), cursorQuery, nullptr);
 
-    std::vector<int64_t> idsToDelete;
-    
-    // We can't delete the documents while we iterate the cursor, so we create the log documents in
-    // a first pass and then go back and delete the documents.
+    // Documents are deleted through a second cursor as the scan reaches them. Sqlite saves the position of
+    // the scanning cursor when its table changes and restores it when the scan moves on.
+    SqliteCursor::ptr deleteCursor = openCursor();
+    IndexCursorHold indexCursors(this);
+    std::vector<std::string> lowlaIds;
+    int deleted = 0;
     std::unique_ptr<CLowlaDBBsonImpl> found = cursor->next();
     while (found) {
         int64_t id = cursor->currentId();
-        updateDocument(cursor->sqliteCursor().get(), id, nullptr, found.get(), cursor->currentMeta().get());
-        idsToDelete.push_back(id);
-        found = cursor->next();
-    }
-
-    // Now go through and delete the documents.
-    for (int64_t id : idsToDelete) {
+        std::unique_ptr<CLowlaDBBsonImpl> meta = cursor->currentMeta();
+        updateDocument(cursor->sqliteCursor().get(), id, nullptr, found.get(), meta.get());
         int rc, res;
-        rc = cursor->sqliteCursor()->movetoUnpacked(nullptr, id, 0, &res);
+        rc = deleteCursor->movetoUnpacked(nullptr, id, 0, &res);
         if (SQLITE_OK == rc && 0 == res) {
             const char *lowlaId;
-			std::unique_ptr<CLowlaDBBsonImpl> meta = cursor->currentMeta();
             meta->stringForKey("id", &lowlaId);
-            cursor->sqliteCursor()->deleteCurrent();
-            forgetLowlaId(lowlaId);
+            lowlaIds.push_back(lowlaId);
+            deleteDocument(deleteCursor.get(), id, found.get());
+            ++deleted;
         }
+        found = cursor->next();
     }
+    forgetLowlaIds(lowlaIds);
 
+    indexCursors.release();
+    deleteCursor.reset();
+    cursor.reset();
+    notifyListeners();
+    tx.commit();
+    std::unique_ptr<CLowlaDBWriteResultImpl> wr(new CLowlaDBWriteResultImpl);
+    wr->setDocumentCount(deleted);
+    return wr;
+}
+
+// Removes every document. The log records are written in one walk of the collection and then the
+// collection and its indexes are emptied a page at a time.
+std::unique_ptr<CLowlaDBWriteResultImpl> CLowlaDBCollectionImpl::truncate() {
+    Tx tx(m_db->btree());
+    
+    SqliteCursor::ptr cursor = openCursor();
+    i64 count = cursor->count();
+    if (m_writeLog) {
+        // A row holds the document followed by its metadata, which is exactly what its log record holds
+        SqliteCursor::ptr logCursor = openLogCursor();
+        std::vector<char> row;
+        int res;
+        int rc = cursor->first(&res);
+        while (SQLITE_OK == rc && 0 == res) {
+            i64 id;
+            cursor->keySize(&id);
+            int logRes;
+            rc = logCursor->movetoUnpacked(nullptr, id, 0, &logRes);
+            if (SQLITE_OK == rc && 0 != logRes) {
+                u32 size;
+                cursor->dataSize(&size);
+                row.resize(size);
+                cursor->data(0, size, row.data());
+                rc = logCursor->insert(nullptr, id, row.data(), (int)size, 0, false, logRes);
+            }
+            if (SQLITE_OK == rc) {
+                rc = cursor->next(&res);
+            }
+        }
+        if (SQLITE_OK != rc) {
+            throw TeamstudioException("Unable to log removed documents, rc=" + utf16string::valueOf(rc));
+        }
+    }
     cursor.reset();
+    
+    refreshSchema();
+    m_db->clearTable(m_root);
+    m_db->clearTable(m_lowlaIndexRoot);
+    for (CLowlaDBIndexImpl::ptr const &index : indexes()) {
+        m_db->clearTable(index->root());
+    }
+    
     notifyListeners();
     tx.commit();
     std::unique_ptr<CLowlaDBWriteResultImpl> wr(new CLowlaDBWriteResultImpl);
-    wr->setDocumentCount((int)idsToDelete.size());
+    wr->setDocumentCount((int)count);
     return wr;
 }
 
@@ -1054,105 +2171,200 @@ std::unique_ptr<CLowlaDBWriteResultImpl> CLowlaDBCollectionImpl::update(CLowlaDB
     if (!found && upsert) {
         return insert(object, "");
     }
+    // Operator updates are compiled once and then applied to every matching document
+    CLowlaDBUpdater::ptr updater;
+    if (!isReplaceObject(object)) {
+        updater = CLowlaDBUpdater::compile(object);
+    }
     std::unique_ptr<CLowlaDBWriteResultImpl> wr(new CLowlaDBWriteResultImpl);
+    IndexCursorHold indexCursors(this);
     while (found) {
         int64_t id = cursor->currentId();
-        std::unique_ptr<CLowlaDBBsonImpl> bsonToWrite = applyUpdate(object, found.get());
+        std::unique_ptr<CLowlaDBBsonImpl> bsonToWrite = applyUpdate(object, updater.get(), found.get());
         updateDocument(cursor->sqliteCursor().get(), id, bsonToWrite.get(), found.get(), cursor->currentMeta().get());
         wr->appendDocument(std::move(bsonToWrite));
+        // Writing through the cursor can leave it unpositioned if the page had to be rebalanced, so put it
+        // back on the document before moving on
+        int res;
+        cursor->sqliteCursor()->movetoUnpacked(nullptr, id, 0, &res);
         
         found = cursor->next();
     }
+    indexCursors.release();
     cursor.reset();
     notifyListeners();
     tx.commit();
     return wr;
 }
 
-std::unique_ptr<CLowlaDBBsonImpl> CLowlaDBCollectionImpl::applyUpdate(CLowlaDBBsonImpl *update, CLowlaDBBsonImpl *original)  {
-    std::unique_ptr<CLowlaDBBsonImpl> answer(new CLowlaDBBsonImpl());
-    if (isReplaceObject(update)) {
-        answer->appendElement(original, "_id");
-        bson_iterator it[1];
-        bson_iterator_init(it, update);
-        while (bson_iterator_next(it)) {
-            if (0 != strcmp("_id", bson_iterator_key(it))) {
-                bson_append_element(answer.get(), nullptr, it);
-            }
+// Updates or removes the first matching document in sort order and returns it as it was before or
+// after the update, all within one transaction. Returns nothing if no document matched.
+std::unique_ptr<CLowlaDBBsonImpl> CLowlaDBCollectionImpl::findAndModify(CLowlaDBBsonImpl *query, CLowlaDBBsonImpl *update, CLowlaDBBsonImpl *sort, bool returnNew, bool upsert, bool remove) {
+    if (!remove) {
+        if (!update) {
+            throw TeamstudioException("findAndModify requires either an update or remove");
         }
-        answer->finish();
+        throwIfDocumentInvalidForUpdate(update);
     }
-    else {
-        const char *tmp;
-        std::shared_ptr<CLowlaDBBsonImpl> set;
-        std::shared_ptr<CLowlaDBBsonImpl> unset;
-        if (update->objectForKey("$set", &tmp)) {
-            set.reset(new CLowlaDBBsonImpl(tmp, CLowlaDBBsonImpl::REF));
+    
+    Tx tx(m_db->btree());
+    
+    // The cursor needs shared_ptrs so we create new ClowlaDBBsonImpls using the incoming data
+    std::shared_ptr<CLowlaDBBsonImpl> cursorQuery;
+    if (query) {
+        cursorQuery.reset(new CLowlaDBBsonImpl(query->data(), CLowlaDBBsonImpl::REF));
+    }
+    std::shared_ptr<CLowlaDBCursorImpl> cursor = std::make_shared<CLowlaDBCursorImpl>(shared_from_this(), cursorQuery, nullptr);
+    cursor = cursor->limit(1);
+    if (sort) {
+        cursor = cursor->sort(std::make_shared<CLowlaDBBsonImpl>(sort->data(), CLowlaDBBsonImpl::REF));
+    }
+    CLowlaDBUpdater::ptr updater;
+    if (!remove && !isReplaceObject(update)) {
+        updater = CLowlaDBUpdater::compile(update);
+    }
+    
+    std::unique_ptr<CLowlaDBBsonImpl> answer;
+    std::unique_ptr<CLowlaDBBsonImpl> found = cursor->next();
+    if (!found) {
+        if (!upsert || remove) {
+            return answer;
+        }
+        // Operator upserts start from the fields that the query matches by value. They go through
+        // $set so that dotted keys become nested fields the query can then find; $set leaves _id
+        // alone, so that is copied across directly.
+        std::unique_ptr<CLowlaDBBsonImpl> newDoc;
+        if (updater) {
+            CLowlaDBBsonImpl idOnly;
+            CLowlaDBBsonImpl equalities;
+            equalities.startObject("$set");
+            if (query) {
+                bson_iterator it[1];
+                bson_iterator_init(it, query);
+                while (BSON_EOO != bson_iterator_next(it)) {
+                    bson_type type = bson_iterator_type(it);
+                    if ('$' != bson_iterator_key(it)[0] && !(BSON_OBJECT == type && isOperatorObject(it))) {
+                        bson_append_element(0 == strcmp("_id", bson_iterator_key(it)) ? &idOnly : &equalities, nullptr, it);
+                    }
+                }
+            }
+            idOnly.finish();
+            equalities.finishObject();
+            equalities.finish();
+            std::unique_ptr<CLowlaDBBsonImpl> base = CLowlaDBUpdater::compile(&equalities)->apply(&idOnly);
+            newDoc = updater->apply(base.get());
         }
         else {
-            set = CLowlaDBBsonImpl::empty();
+            newDoc.reset(new CLowlaDBBsonImpl(update->data(), CLowlaDBBsonImpl::COPY));
         }
-        if (update->objectForKey("$unset", &tmp)) {
-            unset.reset(new CLowlaDBBsonImpl(tmp, CLowlaDBBsonImpl::REF));
+        std::unique_ptr<CLowlaDBWriteResultImpl> wr = insert(newDoc.get(), nullptr);
+        if (returnNew) {
+            answer.reset(new CLowlaDBBsonImpl(wr->getDocument(0), CLowlaDBBsonImpl::COPY));
+        }
+    }
+    else {
+        int64_t id = cursor->currentId();
+        std::unique_ptr<CLowlaDBBsonImpl> meta = cursor->currentMeta();
+        if (remove) {
+            updateDocument(cursor->sqliteCursor().get(), id, nullptr, found.get(), meta.get());
+            const char *lowlaId;
+            meta->stringForKey("id", &lowlaId);
+            forgetLowlaId(lowlaId);
+            deleteDocument(cursor->sqliteCursor().get(), id, found.get());
+            answer = std::move(found);
         }
         else {
-            unset = CLowlaDBBsonImpl::empty();
+            std::unique_ptr<CLowlaDBBsonImpl> bsonToWrite = applyUpdate(update, updater.get(), found.get());
+            updateDocument(cursor->sqliteCursor().get(), id, bsonToWrite.get(), found.get(), meta.get());
+            answer = returnNew ? std::move(bsonToWrite) : std::move(found);
         }
-        answer->appendElement(original, "_id");
-        bson_iterator it[1];
-        bson_iterator_init(it, original);
-        while (bson_iterator_next(it)) {
-            const char *key = bson_iterator_key(it);
-            if (0 == strcmp("_id", key)) {
-                continue;
-            }
-            else if (set->containsKey(key)) {
-                answer->appendElement(set.get(), key);
-            }
-            else if (unset->containsKey(key)) {
-                continue;
-            }
-            else {
-                answer->appendElement(original, key);
-            }
-        }
-        bson_iterator_init(it, set.get());
-        while (bson_iterator_next(it)) {
-            const char *key = bson_iterator_key(it);
-            if (!original->containsKey(key)) {
-                bson_append_element(answer.get(), nullptr, it);
-            }
+    }
+    cursor.reset();
+    notifyListeners();
+    tx.commit();
+    return answer;
+}
+
+std::unique_ptr<CLowlaDBBsonImpl> CLowlaDBCollectionImpl::applyUpdate(CLowlaDBBsonImpl *update, CLowlaDBUpdater *updater, CLowlaDBBsonImpl *original)  {
+    if (updater) {
+        return updater->apply(original);
+    }
+    std::unique_ptr<CLowlaDBBsonImpl> answer(new CLowlaDBBsonImpl());
+    answer->appendElement(original, "_id");
+    bson_iterator it[1];
+    bson_iterator_init(it, update);
+    while (bson_iterator_next(it)) {
+        if (0 != strcmp("_id", bson_iterator_key(it))) {
+            bson_append_element(answer.get(), nullptr, it);
         }
-        answer->finish();
     }
+    answer->finish();
     return answer;
 }
 
 void CLowlaDBCollectionImpl::updateDocument(SqliteCursor *cursor, int64_t id, CLowlaDBBsonImpl *obj, CLowlaDBBsonImpl *oldObj, CLowlaDBBsonImpl *oldMeta) {
     int rc = 0, res;
     if (obj) {
-        rc = cursor->insert(NULL, id, obj->data(), (int)obj->size(), (int)oldMeta->size(), false, 0);
+        if (!patchDocument(cursor, obj, oldObj, oldMeta, &rc)) {
+            rc = cursor->insertGather(id, obj->data(), (int)obj->size(), oldMeta->data(), (int)oldMeta->size(), false, 0);
+        }
         if (SQLITE_OK == rc) {
-            cursor->movetoUnpacked(nullptr, id, 0, &res);
-            rc = cursor->putData((int)obj->size(), (int)oldMeta->size(), oldMeta->data());
+            reindexDocument(id, obj, oldObj);
         }
     }
     if (SQLITE_OK == rc && m_writeLog) {
-        SqliteCursor::ptr logCursor = m_db->openCursor(m_logRoot);
+        SqliteCursor::ptr logCursor = openLogCursor();
         rc = logCursor->movetoUnpacked(nullptr, id, 0, &res);
         if (SQLITE_OK == rc && 0 != res) {
-            logCursor->insert(nullptr, id, oldObj->data(), (int)oldObj->size(), (int)oldMeta->size(), false, res);
-            if (SQLITE_OK == rc) {
-                logCursor->movetoUnpacked(nullptr, id, 0, &res);
-                rc = logCursor->putData((int)oldObj->size(), (int)oldMeta->size(), oldMeta->data());
+            rc = logCursor->insertGather(id, oldObj->data(), (int)oldObj->size(), oldMeta->data(), (int)oldMeta->size(), false, res);
+        }
+    }
+}
+
+// Updates that keep the size of the document, such as counters and flags, are patched in place so only
+// the bytes that changed are written. The cursor must be on the document's row, and the row must hold
+// oldObj followed by oldMeta; otherwise the document has to be rewritten and this returns false.
+bool CLowlaDBCollectionImpl::patchDocument(SqliteCursor *cursor, CLowlaDBBsonImpl *obj, CLowlaDBBsonImpl *oldObj, CLowlaDBBsonImpl *oldMeta, int *pRc) {
+    u32 dataSize;
+    if (obj->size() != oldObj->size() || SQLITE_OK != cursor->dataSize(&dataSize) || dataSize != obj->size() + oldMeta->size()) {
+        return false;
+    }
+    // Reading the row is far cheaper than rewriting it, and patching anything but the old bytes would
+    // corrupt the document
+    std::vector<char> row(dataSize);
+    if (SQLITE_OK != cursor->data(0, dataSize, row.data()) || 0 != memcmp(row.data(), oldObj->data(), oldObj->size()) || 0 != memcmp(row.data() + oldObj->size(), oldMeta->data(), oldMeta->size())) {
+        return false;
+    }
+    // Each run of changed bytes is written separately, joining runs that are only a few bytes apart
+    static const size_t maxGap = 16;
+    const char *data = obj->data();
+    const char *oldData = oldObj->data();
+    size_t size = obj->size();
+    size_t pos = 0;
+    *pRc = SQLITE_OK;
+    while (SQLITE_OK == *pRc) {
+        while (pos < size && data[pos] == oldData[pos]) {
+            ++pos;
+        }
+        if (pos == size) {
+            break;
+        }
+        size_t first = pos;
+        size_t last = pos;
+        while (pos < size && pos - last <= maxGap) {
+            if (data[pos] != oldData[pos]) {
+                last = pos;
             }
+            ++pos;
         }
+        *pRc = cursor->putData((u32)first, (u32)(last + 1 - first), data + first);
+        pos = last + 1;
     }
+    return true;
 }
 
 void CLowlaDBCollectionImpl::notifyListeners() {
-    utf16string ns = m_db->name() + "." + m_name;
-    CLowlaDBCollectionListenerImpl::instance()->notifyListeners(ns.c_str());
+    CLowlaDBCollectionListenerImpl::instance()->notifyListeners(ns().c_str());
 }
 
 bool CLowlaDBCollectionImpl::isReplaceObject(CLowlaDBBsonImpl *update) {
@@ -1166,48 +2378,115 @@ bool CLowlaDBCollectionImpl::isReplaceObject(CLowlaDBBsonImpl *update) {
 }
 
 SqliteCursor::ptr CLowlaDBCollectionImpl::openCursor() {
+    refreshSchema();
     return m_db->openCursor(m_root);
 }
 
 SqliteCursor::ptr CLowlaDBCollectionImpl::openLogCursor() {
+    refreshSchema();
     return m_db->openCursor(m_logRoot);
 }
 
-void CLowlaDBCollectionImpl::registerLowlaId(const char *lowlaId, i64 id) {
-    Btree *pBt = m_db->btree();
-    
-    Tx tx(pBt);
-    
-    SqliteCursor lowlaCursor;
-    lowlaCursor.create(pBt, m_lowlaIndexRoot, CURSOR_READWRITE, LowlaIdKey::getKeyInfo());
-    
+// While held, every lowla index operation shares one cursor instead of opening its own. The holder
+// must release it before its transaction ends.
+void CLowlaDBCollectionImpl::holdLowlaIndexCursor() {
+    if (0 == m_lowlaCursorHolds++) {
+        refreshSchema();
+        m_lowlaCursor = m_db->openCursor(m_lowlaIndexRoot, LowlaIdKey::getKeyInfo());
+    }
+}
+
+void CLowlaDBCollectionImpl::releaseLowlaIndexCursor() {
+    if (0 == --m_lowlaCursorHolds) {
+        m_lowlaCursor.reset();
+    }
+}
+
+// Likewise for the secondary indexes, so a write call touching many documents opens each index once
+void CLowlaDBCollectionImpl::holdIndexCursors() {
+    ++m_indexCursorHolds;
+}
+
+void CLowlaDBCollectionImpl::releaseIndexCursors() {
+    if (0 == --m_indexCursorHolds) {
+        m_indexCursors.clear();
+    }
+}
+
+SqliteCursor::ptr CLowlaDBCollectionImpl::openIndexCursor(CLowlaDBIndexImpl *index) {
+    if (0 == m_indexCursorHolds) {
+        return m_db->openCursor(index->root(), IndexKey::getKeyInfo());
+    }
+    SqliteCursor::ptr &answer = m_indexCursors[index->root()];
+    if (!answer) {
+        answer = m_db->openCursor(index->root(), IndexKey::getKeyInfo());
+    }
+    return answer;
+}
+
+SqliteCursor::ptr CLowlaDBCollectionImpl::openLowlaIndexCursor() {
+    if (m_lowlaCursor) {
+        return m_lowlaCursor;
+    }
+    refreshSchema();
+    return m_db->openCursor(m_lowlaIndexRoot, LowlaIdKey::getKeyInfo());
+}
+
+static void insertLowlaId(SqliteCursor *lowlaCursor, const char *lowlaId, i64 id) {
     LowlaIdKey key(lowlaId, id);
     int keySize = key.getSize();
     std::vector<unsigned char> ac(keySize);
     key.writeToPointer(&ac[0]);
-    lowlaCursor.insert(&ac[0], keySize, nullptr, 0, 0, false, 0);
+    lowlaCursor->insert(&ac[0], keySize, nullptr, 0, 0, false, 0);
+}
+
+void CLowlaDBCollectionImpl::registerLowlaId(const char *lowlaId, i64 id) {
+    Tx tx(m_db->btree());
     
-    lowlaCursor.close();
+    insertLowlaId(openLowlaIndexCursor().get(), lowlaId, id);
     
     tx.commit();
 }
 
-i64 CLowlaDBCollectionImpl::locateLowlaId(const char *lowlaId) {
-    Btree *pBt = m_db->btree();
+// Inserts the entries in index order so that consecutive writes land on the same pages
+void CLowlaDBCollectionImpl::registerLowlaIds(std::vector<std::pair<std::string, i64>> &entries) {
+    std::sort(entries.begin(), entries.end(), [](std::pair<std::string, i64> const &a, std::pair<std::string, i64> const &b) {
+        int sizeA = (int)a.first.size() + sqlite3VarintLen(a.second);
+        int sizeB = (int)b.first.size() + sqlite3VarintLen(b.second);
+        return sizeA != sizeB ? sizeA < sizeB : a.first < b.first;
+    });
     
-    Tx tx(pBt);
+    Tx tx(m_db->btree());
     
-    SqliteCursor lowlaCursor;
-    lowlaCursor.create(pBt, m_lowlaIndexRoot, CURSOR_READWRITE, LowlaIdKey::getKeyInfo());
+    SqliteCursor::ptr lowlaCursor = openLowlaIndexCursor();
+    for (std::pair<std::string, i64> const &entry : entries) {
+        insertLowlaId(lowlaCursor.get(), entry.first.c_str(), entry.second);
+    }
     
-    LowlaIdKey key(lowlaId, 0);
-    int rc, res;
-    rc = lowlaCursor.movetoUnpacked(&key, 0, 0, &res);
-    i64 answer = 0;
-    if (0 == res) {
-		answer = key.getId();
+    tx.commit();
+}
+
+// Lowla index keys compare by total length before content and the length includes the varint record
+// id, so we have to probe with an id of each possible varint length to find records with large ids.
+static i64 seekLowlaId(SqliteCursor *lowlaCursor, const char *lowlaId) {
+    for (int shift = 0 ; shift <= 56 ; shift += 7) {
+        LowlaIdKey key(lowlaId, (i64)1 << shift);
+        int res;
+        int rc = lowlaCursor->movetoUnpacked(&key, 0, 0, &res);
+        if (SQLITE_OK != rc) {
+            break;
+        }
+        if (0 == res) {
+            return key.getId();
+        }
     }
-    lowlaCursor.close();
+    return 0;
+}
+
+i64 CLowlaDBCollectionImpl::locateLowlaId(const char *lowlaId) {
+    Tx tx(m_db->btree());
+    
+    i64 answer = seekLowlaId(openLowlaIndexCursor().get(), lowlaId);
     
     tx.commit();
     
@@ -1215,26 +2494,204 @@ i64 CLowlaDBCollectionImpl::locateLowlaId(const char *lowlaId) {
 }
 
 void CLowlaDBCollectionImpl::forgetLowlaId(const char *lowlaId) {
+    Tx tx(m_db->btree());
+    
+    SqliteCursor::ptr lowlaCursor = openLowlaIndexCursor();
+    if (0 != seekLowlaId(lowlaCursor.get(), lowlaId)) {
+        lowlaCursor->deleteCurrent();
+    }
+    
+    tx.commit();
+}
+
+void CLowlaDBCollectionImpl::forgetLowlaIds(std::vector<std::string> &lowlaIds) {
+    std::sort(lowlaIds.begin(), lowlaIds.end(), [](std::string const &a, std::string const &b) {
+        return a.size() != b.size() ? a.size() < b.size() : a < b;
+    });
+    
+    Tx tx(m_db->btree());
+    
+    SqliteCursor::ptr lowlaCursor = openLowlaIndexCursor();
+    for (std::string const &lowlaId : lowlaIds) {
+        if (0 != seekLowlaId(lowlaCursor.get(), lowlaId.c_str())) {
+            lowlaCursor->deleteCurrent();
+        }
+    }
+    
+    tx.commit();
+}
+
+/* The collection may be renamed, gain or lose indexes, or have its root pages moved by a drop under
+ * autovacuum, possibly through other handles, so reload everything from the header when the schema
+ * changes. Nothing may hold a cursor across a change, since a drop needs every cursor closed.
+ */
+void CLowlaDBCollectionImpl::refreshSchema() {
+    u32 cookie = m_db->schemaCookie();
+    if (!m_schemaLoaded || cookie != m_schemaCookie) {
+        CLowlaDBImpl::CollectionRoots roots;
+        if (m_db->collectionForHeaderId(m_headerId, &m_name, &roots)) {
+            m_root = roots.collRoot;
+            m_logRoot = roots.collLogRoot;
+            m_lowlaIndexRoot = roots.lowlaIndexRoot;
+        }
+        m_indexes = m_db->collectionIndexes(m_name);
+        m_schemaCookie = cookie;
+        m_schemaLoaded = true;
+        m_planCache.clear();
+    }
+}
+
+std::vector<CLowlaDBIndexImpl::ptr> const &CLowlaDBCollectionImpl::indexes() {
+    refreshSchema();
+    return m_indexes;
+}
+
+CLowlaDBQueryPlan::ptr CLowlaDBCollectionImpl::cachedPlan(const std::string &shape) {
+    indexes();
+    auto found = m_planCache.find(shape);
+    if (found == m_planCache.end()) {
+        return CLowlaDBQueryPlan::ptr();
+    }
+    return found->second;
+}
+
+void CLowlaDBCollectionImpl::cachePlan(const std::string &shape, CLowlaDBQueryPlan::ptr plan) {
+    // Apps issue a small, fixed set of query shapes; anything more suggests generated queries
+    if (100 <= m_planCache.size()) {
+        m_planCache.clear();
+    }
+    m_planCache[shape] = plan;
+}
+
+CLowlaDBQueryPlan::CLowlaDBQueryPlan() : m_idLookup(false), m_equalityFields(0), m_rangeField(false), m_ordered(false), m_reverse(false) {
+}
+
+void CLowlaDBCollectionImpl::ensureIndex(CLowlaDBBsonImpl *keys) {
+    CLowlaDBKeySpec parsedKeys;
+    parseKeySpec(keys, "index", &parsedKeys);
+    if (parsedKeys.empty()) {
+        throw TeamstudioException("Invalid index specification: at least one key is required");
+    }
+    
     Btree *pBt = m_db->btree();
     
     Tx tx(pBt);
     
-    SqliteCursor lowlaCursor;
-    lowlaCursor.create(pBt, m_lowlaIndexRoot, CURSOR_READWRITE, LowlaIdKey::getKeyInfo());
+    std::vector<CLowlaDBIndexImpl::ptr> newIndexes = indexes();
+    for (CLowlaDBIndexImpl::ptr const &index : newIndexes) {
+        if (index->hasKeys(keys)) {
+            return;
+        }
+    }
+    
+    int root = 0;
+    int rc = sqlite3BtreeCreateTable(pBt, &root, BTREE_BLOBKEY);
+    if (SQLITE_OK != rc) {
+        throw TeamstudioException("Unable to create index, rc=" + utf16string::valueOf(rc));
+    }
+    CLowlaDBIndexImpl::ptr index = std::make_shared<CLowlaDBIndexImpl>(keys->data(), root, false);
+    
+    // Populate the new index from the documents already in the collection
+    SqliteCursor::ptr cursor = openCursor();
+    SqliteCursor::ptr indexCursor = m_db->openCursor(root, IndexKey::getKeyInfo());
+    int res;
+    rc = cursor->first(&res);
+    while (SQLITE_OK == rc && 0 == res) {
+        u32 size;
+        cursor->dataSize(&size);
+        char *data = (char *)bson_malloc(size);
+        cursor->data(0, size, data);
+        CLowlaDBBsonImpl found(data, CLowlaDBBsonImpl::OWN);
+        i64 id;
+        cursor->keySize(&id);
+        std::unique_ptr<CLowlaDBBsonImpl> key = index->createKey(&found);
+        index->insertEntry(indexCursor.get(), key.get(), id);
+        index->noteArrayKey(key.get());
+        rc = cursor->next(&res);
+    }
+    indexCursor->close();
+    cursor->close();
+    
+    newIndexes.push_back(index);
+    m_db->setCollectionIndexes(m_name, newIndexes);
+    
+    tx.commit();
+}
+
+void CLowlaDBCollectionImpl::dropIndex(CLowlaDBBsonImpl *keys) {
+    Tx tx(m_db->btree());
+    
+    std::vector<CLowlaDBIndexImpl::ptr> newIndexes = indexes();
+    auto walk = newIndexes.begin();
+    while (walk != newIndexes.end() && !(*walk)->hasKeys(keys)) {
+        ++walk;
+    }
+    if (walk == newIndexes.end()) {
+        throw TeamstudioException("Index not found");
+    }
+    int root = (*walk)->root();
+    newIndexes.erase(walk);
     
-    LowlaIdKey key(lowlaId, 0);
-    lowlaCursor.deleteKey(&key);
-    lowlaCursor.close();
+    // Update the header first so that any root page relocation by dropTable sees the final list
+    m_db->setCollectionIndexes(m_name, newIndexes);
+    m_db->dropTable(root);
     
     tx.commit();
 }
 
+void CLowlaDBCollectionImpl::indexDocument(int64_t id, CLowlaDBBsonImpl *obj) {
+    bool multikey = false;
+    for (CLowlaDBIndexImpl::ptr const &index : indexes()) {
+        SqliteCursor::ptr indexCursor = openIndexCursor(index.get());
+        std::unique_ptr<CLowlaDBBsonImpl> key = index->createKey(obj);
+        index->insertEntry(indexCursor.get(), key.get(), id);
+        multikey = index->noteArrayKey(key.get()) || multikey;
+    }
+    if (multikey) {
+        m_db->setCollectionIndexes(m_name, m_indexes);
+    }
+}
+
+void CLowlaDBCollectionImpl::reindexDocument(int64_t id, CLowlaDBBsonImpl *obj, CLowlaDBBsonImpl *oldObj) {
+    bool multikey = false;
+    for (CLowlaDBIndexImpl::ptr const &index : indexes()) {
+        std::unique_ptr<CLowlaDBBsonImpl> key = index->createKey(obj);
+        std::unique_ptr<CLowlaDBBsonImpl> oldKey = index->createKey(oldObj);
+        if (key->size() == oldKey->size() && 0 == memcmp(key->data(), oldKey->data(), key->size())) {
+            continue;
+        }
+        SqliteCursor::ptr indexCursor = openIndexCursor(index.get());
+        index->removeEntry(indexCursor.get(), oldKey.get(), id);
+        index->insertEntry(indexCursor.get(), key.get(), id);
+        multikey = index->noteArrayKey(key.get()) || multikey;
+    }
+    if (multikey) {
+        m_db->setCollectionIndexes(m_name, m_indexes);
+    }
+}
+
+void CLowlaDBCollectionImpl::unindexDocument(int64_t id, CLowlaDBBsonImpl *oldObj) {
+    for (CLowlaDBIndexImpl::ptr const &index : indexes()) {
+        SqliteCursor::ptr indexCursor = openIndexCursor(index.get());
+        std::unique_ptr<CLowlaDBBsonImpl> oldKey = index->createKey(oldObj);
+        index->removeEntry(indexCursor.get(), oldKey.get(), id);
+    }
+}
+
+// Deletes the document under the cursor; oldObj is its content, which is needed to unindex it
+void CLowlaDBCollectionImpl::deleteDocument(SqliteCursor *cursor, int64_t id, CLowlaDBBsonImpl *oldObj) {
+    if (!indexes().empty()) {
+        unindexDocument(id, oldObj);
+    }
+    cursor->deleteCurrent();
+}
+
 utf16string CLowlaDBCollectionImpl::name() {
     return m_name;
 }
 
 utf16string CLowlaDBCollectionImpl::ns() {
-    return m_db->name() + "." + m_name;
+    return m_db->name() + "." + name();
 }
 
 CLowlaDBImpl::ptr CLowlaDBCollectionImpl::db() {
@@ -1278,7 +2735,7 @@ std::unique_ptr<CLowlaDBSyncDocumentLocation> CLowlaDBCollectionImpl::locateDocu
         cursor->data(objSize, metaSize, meta);
         answer->m_foundMeta.reset(new CLowlaDBBsonImpl(meta, CLowlaDBBsonImpl::OWN));
     }
-    answer->m_logCursor = m_db->openCursor(m_logRoot);
+    answer->m_logCursor = openLogCursor();
     int resLog;
     int rcLog = answer->m_logCursor->movetoUnpacked(nullptr, answer->m_sqliteId, 0, &resLog);
     answer->m_logFound = (SQLITE_OK == rcLog && 0 == resLog);
@@ -1512,11 +2969,11 @@ size_t CLowlaDBBson::size() {
 CLowlaDBBson::CLowlaDBBson(std::shared_ptr<CLowlaDBBsonImpl> pimpl) : m_pimpl(pimpl) {
 }
                                                                            
-CLowlaDBBsonImpl::CLowlaDBBsonImpl() {
+CLowlaDBBsonImpl::CLowlaDBBsonImpl() : m_lookups(0) {
     bson_init(this);
 }
 
-CLowlaDBBsonImpl::CLowlaDBBsonImpl(const char *data, Mode mode) {
+CLowlaDBBsonImpl::CLowlaDBBsonImpl(const char *data, Mode mode) : m_lookups(0) {
     switch (mode) {
         case OWN:
             bson_init_finished_data(this, (char *)data, true);
@@ -1556,7 +3013,7 @@ void CLowlaDBBsonImpl::finish() {
 bool CLowlaDBBsonImpl::containsKey(const char *key) {
     assert(finished); // Iterators can run off the end of unfinished bson and crash
     bson_iterator it[1];
-    bson_type type = bson_find(it, this, key);
+    bson_type type = findField(it, key);
     return BSON_EOO != type;
 }
 
@@ -1609,7 +3066,7 @@ void CLowlaDBBsonImpl::appendAll(CLowlaDBBsonImpl *bson) {
 
 void CLowlaDBBsonImpl::appendElement(const CLowlaDBBsonImpl *src, const char *key) {
     bson_iterator it[1];
-    bson_type type = bson_find(it, src, key);
+    bson_type type = src->findField(it, key);
     if (BSON_EOO != type) {
         bson_append_element(this, nullptr, it);
     }
@@ -1617,7 +3074,7 @@ void CLowlaDBBsonImpl::appendElement(const CLowlaDBBsonImpl *src, const char *ke
 
 void CLowlaDBBsonImpl::appendElement(const char *newKey, const CLowlaDBBsonImpl *src, const char *key) {
     bson_iterator it[1];
-    bson_type type = bson_find(it, src, key);
+    bson_type type = src->findField(it, key);
     if (BSON_EOO != type) {
         bson_append_element(this, newKey, it);
     }
@@ -1641,7 +3098,7 @@ void CLowlaDBBsonImpl::finishObject() {
 
 bool CLowlaDBBsonImpl::doubleForKey(const char *key, double *ret) {
     bson_iterator it[1];
-    bson_type type = bson_find(it, this, key);
+    bson_type type = findField(it, key);
     if (BSON_DOUBLE == type) {
         *ret = bson_iterator_double(it);
         return true;
@@ -1651,7 +3108,7 @@ bool CLowlaDBBsonImpl::doubleForKey(const char *key, double *ret) {
 
 bool CLowlaDBBsonImpl::stringForKey(const char *key, const char **ret) const {
     bson_iterator it[1];
-    bson_type type = bson_find(it, this, key);
+    bson_type type = findField(it, key);
     if (BSON_STRING == type) {
         *ret = bson_iterator_string(it);
         return true;
@@ -1661,7 +3118,7 @@ bool CLowlaDBBsonImpl::stringForKey(const char *key, const char **ret) const {
 
 bool CLowlaDBBsonImpl::objectForKey(const char *key, const char **ret) {
     bson_iterator it[1];
-    bson_type type = bson_find(it, this, key);
+    bson_type type = findField(it, key);
     if (BSON_OBJECT == type) {
         bson sub[1];
         bson_iterator_subobject_init(it, sub, false);
@@ -1673,7 +3130,7 @@ bool CLowlaDBBsonImpl::objectForKey(const char *key, const char **ret) {
 
 bool CLowlaDBBsonImpl::arrayForKey(const char *key, const char **ret) {
     bson_iterator it[1];
-    bson_type type = bson_find(it, this, key);
+    bson_type type = findField(it, key);
     if (BSON_ARRAY == type) {
         bson sub[1];
         bson_iterator_subobject_init(it, sub, false);
@@ -1685,7 +3142,7 @@ bool CLowlaDBBsonImpl::arrayForKey(const char *key, const char **ret) {
 
 bool CLowlaDBBsonImpl::oidForKey(const char *key, bson_oid_t *ret) {
     bson_iterator it[1];
-    bson_type type = bson_find(it, this, key);
+    bson_type type = findField(it, key);
     if (BSON_OID == type) {
         *ret = *bson_iterator_oid(it);
         return true;
@@ -1695,7 +3152,7 @@ bool CLowlaDBBsonImpl::oidForKey(const char *key, bson_oid_t *ret) {
 
 bool CLowlaDBBsonImpl::boolForKey(const char *key, bool *ret) const {
     bson_iterator it[1];
-    bson_type type = bson_find(it, this, key);
+    bson_type type = findField(it, key);
     if (BSON_BOOL == type) {
         *ret = 0 != bson_iterator_bool_raw(it);
         return true;
@@ -1705,7 +3162,7 @@ bool CLowlaDBBsonImpl::boolForKey(const char *key, bool *ret) const {
 
 bool CLowlaDBBsonImpl::dateForKey(const char *key, bson_date_t *ret) {
     bson_iterator it[1];
-    bson_type type = bson_find(it, this, key);
+    bson_type type = findField(it, key);
     if (BSON_DATE == type) {
         *ret = bson_iterator_date(it);
         return true;
@@ -1715,13 +3172,13 @@ bool CLowlaDBBsonImpl::dateForKey(const char *key, bson_date_t *ret) {
 
 bool CLowlaDBBsonImpl::nullForKey(const char *key) {
     bson_iterator it[1];
-    bson_type type = bson_find(it, this, key);
+    bson_type type = findField(it, key);
     return (BSON_NULL == type);
 }
 
 bool CLowlaDBBsonImpl::intForKey(const char *key, int *ret) {
     bson_iterator it[1];
-    bson_type type = bson_find(it, this, key);
+    bson_type type = findField(it, key);
     if (BSON_INT == type) {
         *ret = bson_iterator_int_raw(it);
         return true;
@@ -1731,7 +3188,7 @@ bool CLowlaDBBsonImpl::intForKey(const char *key, int *ret) {
 
 bool CLowlaDBBsonImpl::longForKey(const char *key, int64_t *ret) {
     bson_iterator it[1];
-    bson_type type = bson_find(it, this, key);
+    bson_type type = findField(it, key);
     if (BSON_LONG == type) {
         *ret = bson_iterator_long_raw(it);
         return true;
@@ -1741,12 +3198,12 @@ bool CLowlaDBBsonImpl::longForKey(const char *key, int64_t *ret) {
 
 bool CLowlaDBBsonImpl::equalValues(const char *key, const CLowlaDBBsonImpl *other, const char *otherKey) {
     bson_iterator it[1];
-    bson_type type = bson_find(it, this, key);
+    bson_type type = findField(it, key);
     if (BSON_EOO == type) {
         return false;
     }
     bson_iterator otherIt[1];
-    bson_type otherType = bson_find(otherIt, other, otherKey);
+    bson_type otherType = other->findField(otherIt, otherKey);
     if (type != otherType) {
         return false;
     }
@@ -1767,6 +3224,73 @@ bool CLowlaDBBsonImpl::isEmpty() {
     return 5 == size();
 }
 
+static uint32_t hashFieldName(const char *key) {
+    uint32_t answer = 2166136261u;
+    while (*key) {
+        answer = (answer ^ (unsigned char)*key++) * 16777619u;
+    }
+    return answer;
+}
+
+// Positions the iterator on the first field with the given name, like bson_find, building the field
+// table on the second lookup
+bson_type CLowlaDBBsonImpl::findField(bson_iterator *it, const char *key) {
+    if (finished && m_fieldTable.empty() && 0 != m_lookups++) {
+        buildFieldTable();
+    }
+    return static_cast<const CLowlaDBBsonImpl *>(this)->findField(it, key);
+}
+
+// Uses the field table if there is one but never builds it
+bson_type CLowlaDBBsonImpl::findField(bson_iterator *it, const char *key) const {
+    if (!finished || m_fieldTable.empty()) {
+        return bson_find(it, this, key);
+    }
+    static const char eoo = 0;
+    const char *base = bson::data;
+    size_t mask = m_fieldTable.size() - 1;
+    for (size_t i = hashFieldName(key) & mask ; ; i = (i + 1) & mask) {
+        uint32_t offset = m_fieldTable[i];
+        if (0 == offset) {
+            it->cur = &eoo;
+            it->first = 0;
+            return BSON_EOO;
+        }
+        if (0 == strcmp(base + offset + 1, key)) {
+            it->cur = base + offset;
+            it->first = 0;
+            return bson_iterator_type(it);
+        }
+    }
+}
+
+void CLowlaDBBsonImpl::buildFieldTable() {
+    const char *base = bson::data;
+    std::vector<uint32_t> offsets;
+    bson_iterator it[1];
+    bson_iterator_init(it, this);
+    while (BSON_EOO != bson_iterator_next(it)) {
+        offsets.push_back((uint32_t)(it->cur - base));
+    }
+    size_t capacity = 8;
+    while (capacity < 2 * offsets.size()) {
+        capacity *= 2;
+    }
+    m_fieldTable.assign(capacity, 0);
+    size_t mask = capacity - 1;
+    for (uint32_t offset : offsets) {
+        const char *key = base + offset + 1;
+        size_t i = hashFieldName(key) & mask;
+        while (0 != m_fieldTable[i] && 0 != strcmp(base + m_fieldTable[i] + 1, key)) {
+            i = (i + 1) & mask;
+        }
+        // Duplicate names keep the first field, which is the one bson_find would return
+        if (0 == m_fieldTable[i]) {
+            m_fieldTable[i] = offset;
+        }
+    }
+}
+
 CLowlaDBCursor::ptr CLowlaDBCursor::create(std::shared_ptr<CLowlaDBCursorImpl> pimpl) {
     return CLowlaDBCursor::ptr(new CLowlaDBCursor(pimpl));
 }
@@ -1776,13 +3300,21 @@ std::shared_ptr<CLowlaDBCursorImpl> CLowlaDBCursor::pimpl() {
 }
 
 CLowlaDBCursor::ptr CLowlaDBCursor::create(CLowlaDBCollection::ptr coll, const char *query) {
+    return create(coll, query, nullptr);
+}
+
+CLowlaDBCursor::ptr CLowlaDBCursor::create(CLowlaDBCollection::ptr coll, const char *query, const char *keys) {
     // Cursors have a complex lifetime so this is one of the few cases where we need to copy the bson
     std::shared_ptr<CLowlaDBBsonImpl> bsonQuery;
     if (query) {
         bsonQuery.reset(new CLowlaDBBsonImpl(query, CLowlaDBBsonImpl::COPY));
     }
+    std::shared_ptr<CLowlaDBBsonImpl> bsonKeys;
+    if (keys) {
+        bsonKeys.reset(new CLowlaDBBsonImpl(keys, CLowlaDBBsonImpl::COPY));
+    }
     
-    return create(std::make_shared<CLowlaDBCursorImpl>(coll->pimpl(), bsonQuery, std::shared_ptr<CLowlaDBBsonImpl>()));
+    return create(std::make_shared<CLowlaDBCursorImpl>(coll->pimpl(), bsonQuery, bsonKeys));
 }
 
 CLowlaDBCursor::ptr CLowlaDBCursor::limit(int limit) {
@@ -1812,17 +3344,34 @@ CLowlaDBBson::ptr CLowlaDBCursor::next() {
     return CLowlaDBBson::create(answer);
 }
 
+size_t CLowlaDBCursor::nextBatch(size_t n, std::vector<char> *buffer, std::vector<size_t> *offsets) {
+    return m_pimpl->nextBatch(n, buffer, offsets);
+}
+
+int64_t CLowlaDBCursor::forEach(LowlaDbDocumentCallback callback, void *user) {
+    return m_pimpl->forEach(callback, user);
+}
+
 int64_t CLowlaDBCursor::count() {
     return m_pimpl->count();
 }
 
+CLowlaDBBson::ptr CLowlaDBCursor::explain() {
+    std::shared_ptr<CLowlaDBBsonImpl> answer = m_pimpl->explain();
+    return CLowlaDBBson::create(answer);
+}
+
 CLowlaDBCursor::CLowlaDBCursor(std::shared_ptr<CLowlaDBCursorImpl> pimpl) : m_pimpl(pimpl) {
 }
 
-CLowlaDBCursorImpl::CLowlaDBCursorImpl(const CLowlaDBCursorImpl &other) : m_coll(other.m_coll), m_query(other.m_query), m_keys(other.m_keys), m_sort(other.m_sort), m_limit(other.m_limit), m_skip(other.m_skip), m_showPending(other.m_showPending), m_showDiskLoc(other.m_showDiskLoc) {
+CLowlaDBCursorImpl::CLowlaDBCursorImpl(const CLowlaDBCursorImpl &other) : m_coll(other.m_coll), m_query(other.m_query), m_keys(other.m_keys), m_sort(other.m_sort), m_limit(other.m_limit), m_skip(other.m_skip), m_showPending(other.m_showPending), m_showDiskLoc(other.m_showDiskLoc), m_started(false) {
+}
+
+CLowlaDBCursorImpl::CLowlaDBCursorImpl(CLowlaDBCollectionImpl::ptr coll, std::shared_ptr<CLowlaDBBsonImpl> query, std::shared_ptr<CLowlaDBBsonImpl> keys) : m_coll(coll), m_query(query), m_keys(keys), m_limit(0), m_skip(0), m_showPending(false), m_showDiskLoc(false), m_started(false) {
 }
 
-CLowlaDBCursorImpl::CLowlaDBCursorImpl(CLowlaDBCollectionImpl::ptr coll, std::shared_ptr<CLowlaDBBsonImpl> query, std::shared_ptr<CLowlaDBBsonImpl> keys) : m_coll(coll), m_query(query), m_keys(keys), m_limit(0), m_skip(0), m_showPending(false), m_showDiskLoc(false) {
+CLowlaDBCursorImpl::~CLowlaDBCursorImpl() {
+    dropSortRuns();
 }
 
 std::unique_ptr<CLowlaDBCursorImpl> CLowlaDBCursorImpl::limit(int limit) {
@@ -1855,311 +3404,1947 @@ std::unique_ptr<CLowlaDBCursorImpl> CLowlaDBCursorImpl::showDiskLoc() {
     return answer;
 }
 
-std::unique_ptr<CLowlaDBBsonImpl> CLowlaDBCursorImpl::next() {
-    if (m_sort) {
-        return nextSorted();
-    }
-    else {
-        return nextUnsorted();
+std::unique_ptr<CLowlaDBBsonImpl> CLowlaDBCursorImpl::next() {
+    i64 id;
+    const char *data = nextDocument(&id);
+    if (nullptr == data) {
+        return std::unique_ptr<CLowlaDBBsonImpl>();
+    }
+    CLowlaDBBsonImpl found(data, CLowlaDBBsonImpl::REF);
+    return project(&found, id);
+}
+
+// Appends up to n documents back to back to buffer and records where each one starts in offsets
+size_t CLowlaDBCursorImpl::nextBatch(size_t n, std::vector<char> *buffer, std::vector<size_t> *offsets) {
+    buffer->clear();
+    offsets->clear();
+    i64 id;
+    const char *data;
+    while (offsets->size() < n && nullptr != (data = nextDocument(&id))) {
+        offsets->push_back(buffer->size());
+        if (needsProjection()) {
+            CLowlaDBBsonImpl found(data, CLowlaDBBsonImpl::REF);
+            std::unique_ptr<CLowlaDBBsonImpl> projected = project(&found, id);
+            buffer->insert(buffer->end(), projected->data(), projected->data() + projected->size());
+        }
+        else {
+            int size;
+            bson_little_endian32(&size, data);
+            buffer->insert(buffer->end(), data, data + size);
+            m_stats.bytesCopied += size;
+        }
+    }
+    return offsets->size();
+}
+
+// Hands each document to the callback straight from the page unless it has to be projected
+int64_t CLowlaDBCursorImpl::forEach(LowlaDbDocumentCallback callback, void *user) {
+    int64_t answer = 0;
+    i64 id;
+    const char *data;
+    while (nullptr != (data = nextDocument(&id))) {
+        ++answer;
+        bool more;
+        if (needsProjection()) {
+            CLowlaDBBsonImpl found(data, CLowlaDBBsonImpl::REF);
+            std::unique_ptr<CLowlaDBBsonImpl> projected = project(&found, id);
+            more = callback(user, projected->data(), projected->size());
+        }
+        else {
+            int size;
+            bson_little_endian32(&size, data);
+            more = callback(user, data, size);
+        }
+        if (!more) {
+            break;
+        }
+    }
+    return answer;
+}
+
+// The next document in the results, read in place and only valid until the cursor moves
+const char *CLowlaDBCursorImpl::nextDocument(int64_t *pId) {
+    if (!m_tx) {
+        openCursors();
+    }
+    if (m_sort && !m_plan->m_ordered) {
+        return nextSorted(pId);
+    }
+    else {
+        return nextUnsorted(pId);
+    }
+}
+
+void CLowlaDBCursorImpl::openCursors() {
+    m_tx.reset(new Tx(m_coll->db()->btree()));
+    m_cursor = m_coll->openCursor();
+    m_logCursor = m_coll->openLogCursor();
+    plan();
+}
+
+void CLowlaDBCursorImpl::plan() {
+    if (m_sort) {
+        parseSortSpec();
+    }
+    if (m_query) {
+        m_matcher = CLowlaDBMatcher::compile(m_query);
+    }
+    if (m_keys) {
+        m_projection = CLowlaDBProjection::compile(m_keys.get());
+    }
+    std::string shape = queryShape();
+    m_plan = m_coll->cachedPlan(shape);
+    m_planCached = !!m_plan;
+    if (!m_plan) {
+        m_plan = createPlan();
+        m_coll->cachePlan(shape, m_plan);
+    }
+    m_idLookupHit = false;
+    if (!m_plan->m_index) {
+        return;
+    }
+    CLowlaDBKeySpec const &keys = m_plan->m_index->parsedKeys();
+    m_indexPrefix.reset(new CLowlaDBBsonImpl);
+    for (size_t i = 0 ; i < m_plan->m_equalityFields ; ++i) {
+        CLowlaDBMatcher::Bounds bounds = m_matcher->boundsFor(keys[i].first);
+        bson_append_element(m_indexPrefix.get(), indexKeyName(keys[i].second), &bounds.m_equality);
+    }
+    m_indexPrefix->finish();
+    if (m_plan->m_rangeField) {
+        std::pair<std::vector<utf16string>, int> const &rangeKey = keys[m_plan->m_equalityFields];
+        m_range = m_matcher->boundsFor(rangeKey.first);
+        m_rangeAscending = (1 == rangeKey.second) != m_plan->m_reverse;
+    }
+    m_indexCursor = m_coll->db()->openCursor(m_plan->m_index->root(), IndexKey::getKeyInfo());
+}
+
+// Appends the field names, operators and value types of a query, leaving out the values
+static void appendQueryShape(std::string *shape, bson_iterator *it) {
+    while (BSON_EOO != bson_iterator_next(it)) {
+        const char *key = bson_iterator_key(it);
+        bson_type type = bson_iterator_type(it);
+        *shape += key;
+        *shape += '\0';
+        *shape += (char)type;
+        bool isLogical = 0 == strcmp("$and", key) || 0 == strcmp("$or", key);
+        if ((BSON_OBJECT == type && isOperatorObject(it)) || (BSON_ARRAY == type && isLogical) || (BSON_OBJECT == type && '0' <= key[0] && key[0] <= '9')) {
+            bson_iterator sub[1];
+            bson_iterator_subiterator(it, sub);
+            *shape += '{';
+            appendQueryShape(shape, sub);
+            *shape += '}';
+        }
+    }
+}
+
+// The shape of the query followed by the sort
+std::string CLowlaDBCursorImpl::queryShape() {
+    std::string answer;
+    if (m_query) {
+        bson_iterator it[1];
+        bson_iterator_init(it, m_query.get());
+        appendQueryShape(&answer, it);
+    }
+    answer += '\0';
+    if (m_sort) {
+        answer.append(m_sort->data(), m_sort->size());
+    }
+    return answer;
+}
+
+CLowlaDBQueryPlan::ptr CLowlaDBCursorImpl::createPlan() {
+    CLowlaDBQueryPlan::ptr answer = std::make_shared<CLowlaDBQueryPlan>();
+    
+    // Lowla ids are derived from string and ObjectID _ids, so those can go straight to the document
+    bson_iterator idValue[1];
+    if (idEquality(idValue)) {
+        bson_type type = bson_iterator_type(idValue);
+        answer->m_idLookup = BSON_STRING == type || BSON_OID == type;
+    }
+    
+    // Rank indexes by the number of fields matched by equality, then by whether the next field is
+    // bounded by a range, then by whether the index also yields the sort order
+    answer->m_ordered = !m_sort || providesSort(CLowlaDBKeySpec(), 0, &answer->m_reverse);
+    for (CLowlaDBIndexImpl::ptr const &index : m_coll->indexes()) {
+        CLowlaDBKeySpec const &keys = index->parsedKeys();
+        size_t equalityFields = 0;
+        while (equalityFields < keys.size() && isEqualityField(keys[equalityFields].first)) {
+            ++equalityFields;
+        }
+        bool rangeField = false;
+        if (m_matcher && equalityFields < keys.size()) {
+            CLowlaDBMatcher::Bounds bounds = m_matcher->boundsFor(keys[equalityFields].first);
+            rangeField = bounds.m_hasLower || bounds.m_hasUpper;
+        }
+        // Arrays sort by their elements, which an index keyed on whole arrays can't provide
+        bool reverse = false;
+        bool ordered = m_sort && !index->isMultikey() && providesSort(keys, equalityFields, &reverse);
+        if (0 == equalityFields && !rangeField && !ordered) {
+            continue;
+        }
+        int rank = ((int)equalityFields * 2 + (rangeField ? 1 : 0)) * 2 + (ordered ? 1 : 0);
+        int bestRank = ((int)answer->m_equalityFields * 2 + (answer->m_rangeField ? 1 : 0)) * 2 + (answer->m_ordered && m_sort ? 1 : 0);
+        if (!answer->m_index || bestRank < rank) {
+            answer->m_index = index;
+            answer->m_equalityFields = equalityFields;
+            answer->m_rangeField = rangeField;
+            answer->m_ordered = ordered || !m_sort;
+            answer->m_reverse = reverse;
+        }
+    }
+    return answer;
+}
+
+bool CLowlaDBCursorImpl::isEqualityField(std::vector<utf16string> const &path) {
+    return m_matcher && m_matcher->boundsFor(path).m_hasEquality;
+}
+
+bool CLowlaDBCursorImpl::idEquality(bson_iterator *value) {
+    if (!m_matcher) {
+        return false;
+    }
+    CLowlaDBMatcher::Bounds bounds = m_matcher->boundsFor(std::vector<utf16string>(1, "_id"));
+    *value = bounds.m_equality;
+    return bounds.m_hasEquality;
+}
+
+// The bounds of the range field in the order the index is walked
+bool CLowlaDBCursorImpl::rangeStart(bson_iterator *value, bool *pInclusive) {
+    *value = m_rangeAscending ? m_range.m_lower : m_range.m_upper;
+    *pInclusive = m_rangeAscending ? m_range.m_lowerInclusive : m_range.m_upperInclusive;
+    return m_rangeAscending ? m_range.m_hasLower : m_range.m_hasUpper;
+}
+
+bool CLowlaDBCursorImpl::rangeEnd(bson_iterator *value, bool *pInclusive) {
+    *value = m_rangeAscending ? m_range.m_upper : m_range.m_lower;
+    *pInclusive = m_rangeAscending ? m_range.m_upperInclusive : m_range.m_lowerInclusive;
+    return m_rangeAscending ? m_range.m_hasUpper : m_range.m_hasLower;
+}
+
+// Where the range field of an index entry falls: -1 excluded at the start, 0 inside, 1 past the end
+int CLowlaDBCursorImpl::checkRange(const char *entry) {
+    bson_iterator it[1];
+    bson_iterator_from_buffer(it, entry);
+    for (size_t i = 0 ; i <= m_plan->m_equalityFields ; ++i) {
+        bson_iterator_next(it);
+    }
+    bson_iterator bound[1];
+    bool inclusive;
+    if (rangeEnd(bound, &inclusive)) {
+        int compare = compareBsonFields(it, bound);
+        if (!m_rangeAscending) {
+            compare = -compare;
+        }
+        if (0 < compare || (0 == compare && !inclusive)) {
+            return 1;
+        }
+    }
+    if (rangeStart(bound, &inclusive) && !inclusive && 0 == compareBsonFields(it, bound)) {
+        return -1;
+    }
+    return 0;
+}
+
+// Whether walking the index after its equality fields returns documents in sort order. Sort fields
+// bound by equality are the same for every match so they can be ignored.
+bool CLowlaDBCursorImpl::providesSort(CLowlaDBKeySpec const &keys, size_t equalityFields, bool *pReverse) {
+    size_t pos = equalityFields;
+    int direction = 0;
+    for (auto walk = m_parsedSort.begin() ; walk != m_parsedSort.end() ; ++walk) {
+        if (isEqualityField(walk->first)) {
+            continue;
+        }
+        if (pos == keys.size() || keys[pos].first != walk->first) {
+            return false;
+        }
+        int relative = keys[pos].second * walk->second;
+        if (0 != direction && direction != relative) {
+            return false;
+        }
+        direction = relative;
+        ++pos;
+    }
+    *pReverse = direction < 0;
+    return true;
+}
+
+// Positions m_cursor on the first document that might match the query
+int CLowlaDBCursorImpl::firstCandidate(int *pRes) {
+    m_idLookupHit = false;
+    if (m_plan->m_idLookup) {
+        bson_iterator idValue[1];
+        idEquality(idValue);
+        CLowlaDBBsonImpl idQuery;
+        bson_append_element(&idQuery, "_id", idValue);
+        idQuery.finish();
+        utf16string lowlaId = generateLowlaId(m_coll.get(), &idQuery);
+        i64 id = m_coll->locateLowlaId(lowlaId.c_str());
+        if (0 != id) {
+            int rc = m_cursor->movetoUnpacked(nullptr, id, 0, pRes);
+            if (SQLITE_OK == rc && 0 == *pRes) {
+                ++m_stats.entriesExamined;
+                m_idLookupHit = true;
+                return rc;
+            }
+        }
+        // Documents pulled from a server namespace other than ours have lowla ids we can't
+        // predict, so a miss has to fall through to the remaining access path
+    }
+    if (!m_plan->m_index) {
+        int rc = m_cursor->first(pRes);
+        if (SQLITE_OK == rc && 0 == *pRes) {
+            ++m_stats.entriesExamined;
+        }
+        return rc;
+    }
+    m_indexSeen.clear();
+    
+    // Start at the equality prefix, extended with the start of the range if there is one
+    CLowlaDBKeySpec const &keys = m_plan->m_index->parsedKeys();
+    CLowlaDBBsonImpl start;
+    start.appendAll(m_indexPrefix.get());
+    size_t startFields = m_plan->m_equalityFields;
+    bson_iterator startValue[1];
+    bool inclusive;
+    if (m_plan->m_rangeField && rangeStart(startValue, &inclusive)) {
+        bson_append_element(&start, indexKeyName(keys[startFields].second), startValue);
+        ++startFields;
+    }
+    int rc;
+    if (!m_plan->m_reverse) {
+        start.finish();
+        IndexKey key(start.data(), 0);
+        rc = m_indexCursor->movetoUnpacked(&key, 0, 0, pRes);
+        if (SQLITE_OK == rc && *pRes < 0) {
+            rc = m_indexCursor->next(pRes);
+        }
+        else if (SQLITE_OK == rc) {
+            *pRes = 0;
+        }
+    }
+    else {
+        // Seek past the last entry with the start prefix by extending it with a value that sorts
+        // after everything else, or with the largest id if the prefix covers every field
+        i64 startId = 0;
+        if (startFields < keys.size()) {
+            int direction = keys[startFields].second;
+            if (1 == direction) {
+                bson_append_maxkey(&start, indexKeyName(direction));
+            }
+            else {
+                bson_append_minkey(&start, indexKeyName(direction));
+            }
+        }
+        else {
+            startId = LARGEST_INT64;
+        }
+        start.finish();
+        IndexKey key(start.data(), startId);
+        rc = m_indexCursor->movetoUnpacked(&key, 0, 0, pRes);
+        if (SQLITE_OK == rc && 0 <= *pRes) {
+            rc = m_indexCursor->previous(pRes);
+        }
+        else if (SQLITE_OK == rc) {
+            *pRes = 0;
+        }
+    }
+    return seekIndexedDocument(rc, pRes);
+}
+
+int CLowlaDBCursorImpl::nextCandidate(int *pRes) {
+    if (m_idLookupHit) {
+        *pRes = 1;
+        return SQLITE_OK;
+    }
+    if (!m_plan->m_index) {
+        int rc = m_cursor->next(pRes);
+        if (SQLITE_OK == rc && 0 == *pRes) {
+            ++m_stats.entriesExamined;
+        }
+        return rc;
+    }
+    int rc = m_plan->m_reverse ? m_indexCursor->previous(pRes) : m_indexCursor->next(pRes);
+    return seekIndexedDocument(rc, pRes);
+}
+
+int CLowlaDBCursorImpl::seekIndexedDocument(int rc, int *pRes) {
+    while (SQLITE_OK == rc && 0 == *pRes) {
+        ++m_stats.entriesExamined;
+        i64 size;
+        m_indexCursor->keySize(&size);
+        m_indexKey.resize((size_t)size);
+        m_indexCursor->key(0, (u32)size, &m_indexKey[0]);
+        if (!IndexKey::hasPrefix(&m_indexKey[0], m_indexPrefix->data())) {
+            *pRes = 1;
+            break;
+        }
+        int range = m_plan->m_rangeField ? checkRange(&m_indexKey[0]) : 0;
+        if (0 < range) {
+            *pRes = 1;
+            break;
+        }
+        // A document whose key changes while we walk (e.g. a multi update) may reappear further on
+        i64 id = IndexKey::idFromKey(&m_indexKey[0], (int)size);
+        if (0 == range && m_indexSeen.insert(id).second) {
+            int res;
+            rc = m_cursor->movetoUnpacked(nullptr, id, 0, &res);
+            if (SQLITE_OK != rc || 0 == res) {
+                return rc;
+            }
+        }
+        rc = m_plan->m_reverse ? m_indexCursor->previous(pRes) : m_indexCursor->next(pRes);
+    }
+    return rc;
+}
+
+const char *CLowlaDBCursorImpl::nextUnsorted(int64_t *pId) {
+    int rc;
+    int res = 0;
+    if (!m_started) {
+        m_started = true;
+        m_unsortedOffset = 0;
+        rc = firstCandidate(&res);
+    }
+    else {
+        if (0 != m_limit && m_skip + m_limit <= m_unsortedOffset) {
+            return nullptr;
+        }
+        rc = nextCandidate(&res);
+    }
+    while (SQLITE_OK == res && 0 == rc) {
+        const char *data = fetchCurrentDocument();
+        CLowlaDBBsonImpl found(data, CLowlaDBBsonImpl::REF);
+        if (matches(&found)) {
+            ++m_unsortedOffset;
+            if (m_skip < m_unsortedOffset && (0 == m_limit || m_unsortedOffset <= m_skip + m_limit)) {
+                m_cursor->keySize(pId);
+                return data;
+            }
+        }
+        rc = nextCandidate(&res);
+    }
+    return nullptr;
+}
+
+const char *CLowlaDBCursorImpl::nextSorted(int64_t *pId) {
+    int rc;
+    int res = 0;
+    if (!m_started) {
+        m_started = true;
+        performSortedQuery();
+    }
+    
+    while (nextSortedId(pId)) {
+        rc = m_cursor->movetoUnpacked(nullptr, *pId, 1, &res);
+        if (SQLITE_OK != rc || 0 != res) {
+            continue;
+        }
+        ++m_stats.entriesExamined;
+        return fetchCurrentDocument();
+    }
+    return nullptr;
+}
+
+// Types that compare as the same kind of value (all numbers, strings and symbols)
+static int canonicalBsonType(int type)
+{
+    if (BSON_LONG == type || BSON_DOUBLE == type) {
+        return BSON_INT;
+    }
+    if (BSON_SYMBOL == type) {
+        return BSON_STRING;
+    }
+    return type;
+}
+
+// The number of bytes in the value under the iterator, found by stepping a copy past it
+static size_t bsonValueSize(bson_iterator *it) {
+    const char *value = bson_iterator_value(it);
+    bson_iterator next = *it;
+    bson_iterator_next(&next);
+    return next.cur - value;
+}
+
+/* Compare two bson values using the algorithm described at http://docs.mongodb.org/master/reference/method/cursor.sort/#cursor.sort
+ */
+static int compareBsonFields(bson_iterator *itA, bson_iterator *itB)
+{
+    static const int typeOrder[] = { BSON_MINKEY, BSON_NULL, BSON_INT, BSON_STRING, BSON_OBJECT, BSON_ARRAY, BSON_BINDATA, BSON_OID, BSON_BOOL, BSON_DATE, BSON_TIMESTAMP, BSON_REGEX, BSON_MAXKEY};
+    
+    int typeA = canonicalBsonType(bson_iterator_type(itA));
+    int typeB = canonicalBsonType(bson_iterator_type(itB));
+
+    if (typeA != typeB) {
+        const int *end = typeOrder + sizeof(typeOrder) / sizeof(int);
+        auto posA = std::find(typeOrder, end, typeA);
+        auto posB = std::find(typeOrder, end, typeB);
+        if (posA != posB) {
+            return posA < posB ? -1 : +1;
+        }
+        // Neither type is in the table; fall back to the type codes so the ordering stays consistent
+        return typeA < typeB ? -1 : +1;
+    }
+    switch (typeA) {
+        case BSON_MINKEY:
+        case BSON_NULL:
+        case BSON_MAXKEY:
+            return 0;
+        case BSON_INT: {
+            // Doubles can't represent every long, so only go through double when one side is one
+            if (BSON_DOUBLE != bson_iterator_type(itA) && BSON_DOUBLE != bson_iterator_type(itB)) {
+                int64_t lA = bson_iterator_long(itA);
+                int64_t lB = bson_iterator_long(itB);
+                return lA < lB ? -1 : (lB < lA ? +1 : 0);
+            }
+            double dA = bson_iterator_double(itA);
+            double dB = bson_iterator_double(itB);
+            return dA < dB ? -1 : (dB < dA ? +1 : 0);
+        }
+        case BSON_STRING:
+            return strcmp(bson_iterator_string(itA), bson_iterator_string(itB));
+        case BSON_OBJECT:
+        case BSON_ARRAY: {
+            bson subA[1];
+            bson subB[1];
+            bson_iterator_subobject_init(itA, subA, false);
+            bson_iterator_subobject_init(itB, subB, false);
+            if (bson_size(subA) != bson_size(subB) ) {
+                return bson_size(subA) < bson_size(subB) ? -1 : +1;
+            }
+            return memcmp(bson_data(subA), bson_data(subB), bson_size(subA));
+        }
+        case BSON_BINDATA:
+            if (bson_iterator_bin_len(itA) != bson_iterator_bin_len(itB)) {
+                return bson_iterator_bin_len(itA) < bson_iterator_bin_len(itB) ? -1 : +1;
+            }
+            if (bson_iterator_bin_type(itA) != bson_iterator_bin_type(itB)) {
+                return bson_iterator_bin_type(itA) < bson_iterator_bin_type(itB) ? -1 : +1;
+            }
+            return memcmp(bson_iterator_bin_data(itA), bson_iterator_bin_data(itB), bson_iterator_bin_len(itA));
+        case BSON_OID:
+            return memcmp(bson_iterator_oid(itA), bson_iterator_oid(itB), sizeof(bson_oid_t));
+        case BSON_BOOL:
+            if (!bson_iterator_bool(itA)) {
+                return bson_iterator_bool(itB) ? -1 : 0;
+            }
+            else {
+                return bson_iterator_bool(itB) ? 0 : +1;
+            }
+        case BSON_DATE: {
+            bson_date_t dA = bson_iterator_date(itA);
+            bson_date_t dB = bson_iterator_date(itB);
+            return dA < dB ? -1 : (dA == dB ? 0 : +1);
+        }
+        case BSON_TIMESTAMP: {
+            bson_timestamp_t tsA = bson_iterator_timestamp(itA);
+            bson_timestamp_t tsB = bson_iterator_timestamp(itB);
+            if (tsA.t != tsB.t) {
+                return (unsigned)tsA.t < (unsigned)tsB.t ? -1 : +1;
+            }
+            return tsA.i == tsB.i ? 0 : ((unsigned)tsA.i < (unsigned)tsB.i ? -1 : +1);
+        }
+        case BSON_REGEX: {
+            int answer = strcmp(bson_iterator_regex(itA), bson_iterator_regex(itB));
+            return 0 != answer ? answer : strcmp(bson_iterator_regex_opts(itA), bson_iterator_regex_opts(itB));
+        }
+    }
+    // Anything else (code, dbref, undefined...) has no defined order, so just compare the bytes
+    size_t sizeA = bsonValueSize(itA);
+    size_t sizeB = bsonValueSize(itB);
+    if (sizeA != sizeB) {
+        return sizeA < sizeB ? -1 : +1;
+    }
+    return memcmp(bson_iterator_value(itA), bson_iterator_value(itB), sizeA);
+}
+
+static void appendBigEndian(std::string *out, uint64_t value, int bytes) {
+    for (int shift = (bytes - 1) * 8 ; 0 <= shift ; shift -= 8) {
+        out->push_back((char)(value >> shift));
+    }
+}
+
+/* Append a bson value to a normalized key so that memcmp on two keys orders them the same way as
+ * compareBsonFields: a type rank byte followed by an encoding of the value that never makes one
+ * value a prefix of another. Descending fields have their bytes inverted. Numbers are encoded as
+ * their nearest double followed by their exact integer part, so longs too close to tell apart as
+ * doubles still sort in order.
+ */
+static void appendNormalizedValue(std::string *out, bson_iterator *it, bool descending)
+{
+    static const int typeOrder[] = { BSON_MINKEY, BSON_NULL, BSON_INT, BSON_STRING, BSON_OBJECT, BSON_ARRAY, BSON_BINDATA, BSON_OID, BSON_BOOL, BSON_DATE, BSON_TIMESTAMP, BSON_REGEX, BSON_MAXKEY};
+    const int *end = typeOrder + sizeof(typeOrder) / sizeof(int);
+
+    size_t start = out->size();
+    int type = canonicalBsonType(bson_iterator_type(it));
+    const int *pos = std::find(typeOrder, end, type);
+    // Types missing from the table sort after it by type code, as in compareBsonFields
+    out->push_back((char)(pos != end ? pos - typeOrder : (end - typeOrder) + type));
+    switch (type) {
+        case BSON_INT: {
+            // Flip the sign bit of positive doubles and every bit of negative ones
+            double d = bson_iterator_double(it);
+            if (0 == d) {
+                d = 0;
+            }
+            uint64_t bits;
+            memcpy(&bits, &d, sizeof(bits));
+            bits = (bits & 0x8000000000000000ULL) ? ~bits : (bits | 0x8000000000000000ULL);
+            if (d != d) {
+                // NaN sorts before every other number
+                bits = 0;
+            }
+            appendBigEndian(out, bits, 8);
+            // Ints and longs break ties exactly; doubles use their integer part, clamped to a long
+            int64_t exact;
+            if (BSON_DOUBLE != bson_iterator_type(it)) {
+                exact = bson_iterator_long(it);
+            }
+            else if (d != d) {
+                exact = 0;
+            }
+            else if (d >= 9223372036854775808.0) {
+                exact = LLONG_MAX;
+            }
+            else if (d < -9223372036854775808.0) {
+                exact = LLONG_MIN;
+            }
+            else {
+                exact = (int64_t)d;
+            }
+            appendBigEndian(out, (uint64_t)exact ^ 0x8000000000000000ULL, 8);
+            break;
+        }
+        case BSON_STRING: {
+            const char *str = bson_iterator_string(it);
+            out->append(str, strlen(str) + 1);
+            break;
+        }
+        case BSON_OBJECT:
+        case BSON_ARRAY: {
+            bson sub[1];
+            bson_iterator_subobject_init(it, sub, false);
+            appendBigEndian(out, (uint32_t)bson_size(sub), 4);
+            out->append(bson_data(sub), bson_size(sub));
+            break;
+        }
+        case BSON_BINDATA:
+            appendBigEndian(out, (uint32_t)bson_iterator_bin_len(it), 4);
+            out->push_back((char)bson_iterator_bin_type(it));
+            out->append(bson_iterator_bin_data(it), bson_iterator_bin_len(it));
+            break;
+        case BSON_OID:
+            out->append((const char *)bson_iterator_oid(it), sizeof(bson_oid_t));
+            break;
+        case BSON_BOOL:
+            out->push_back(bson_iterator_bool(it) ? 1 : 0);
+            break;
+        case BSON_DATE:
+            appendBigEndian(out, (uint64_t)bson_iterator_date(it) ^ 0x8000000000000000ULL, 8);
+            break;
+        case BSON_TIMESTAMP: {
+            bson_timestamp_t ts = bson_iterator_timestamp(it);
+            appendBigEndian(out, (uint32_t)ts.t, 4);
+            appendBigEndian(out, (uint32_t)ts.i, 4);
+            break;
+        }
+        case BSON_REGEX: {
+            const char *regex = bson_iterator_regex(it);
+            const char *opts = bson_iterator_regex_opts(it);
+            out->append(regex, strlen(regex) + 1);
+            out->append(opts, strlen(opts) + 1);
+            break;
+        }
+        case BSON_MINKEY:
+        case BSON_NULL:
+        case BSON_MAXKEY:
+            break;
+        default: {
+            // Code, dbref, undefined... compare by size and then bytes
+            size_t size = bsonValueSize(it);
+            appendBigEndian(out, (uint32_t)size, 4);
+            out->append(bson_iterator_value(it), size);
+            break;
+        }
+    }
+    if (descending) {
+        for (size_t i = start ; i < out->size() ; ++i) {
+            (*out)[i] = ~(*out)[i];
+        }
+    }
+}
+
+// Sorts whose keys need more memory than this spill sorted runs to temporary tables
+static size_t sortMemoryBudget = 4 * 1024 * 1024;
+
+static bool lessSortEntry(const char *keys, std::tuple<size_t, size_t, int64_t> const &a, std::tuple<size_t, size_t, int64_t> const &b) {
+    size_t lenA = std::get<1>(a);
+    size_t lenB = std::get<1>(b);
+    int compare = memcmp(keys + std::get<0>(a), keys + std::get<0>(b), std::min(lenA, lenB));
+    return 0 != compare ? compare < 0 : lenA < lenB;
+}
+
+// Run keys are a normalized sort key followed by the big-endian position in the run and the
+// document id, so plain memcmp keeps them in run order
+static int compareSortRunKeys(void *, int n1, const void *key1, int n2, const void *key2) {
+    int compare = memcmp(key1, key2, std::min(n1, n2));
+    return 0 != compare ? compare : n1 - n2;
+}
+
+// Reads the run key under the cursor. keyFetch only sees the part of a key stored on its page, so
+// long keys that spill onto overflow pages are copied with key() instead.
+static void readSortRunKey(SqliteCursor *cursor, std::string *key) {
+    i64 size;
+    cursor->keySize(&size);
+    u32 available;
+    const void *local = cursor->keyFetch(&available);
+    if (nullptr != local && size <= available) {
+        key->assign((const char *)local, (size_t)size);
+    }
+    else {
+        key->resize((size_t)size);
+        cursor->key(0, (u32)size, &(*key)[0]);
+    }
+}
+
+static KeyInfo *sortRunKeyInfo() {
+    static KeyInfo keyInfo;
+    static CollSeq collSeq;
+    keyInfo.nField = 1;
+    keyInfo.aColl[0] = &collSeq;
+    keyInfo.aSortOrder = (u8 *)1;
+    collSeq.xCmp = compareSortRunKeys;
+    return &keyInfo;
+}
+
+// Orders heap entries (sort key, scan position, id) by key and then by scan position, so that
+// documents with equal keys come out in the order they were found
+class TopKLess {
+public:
+    typedef std::tuple<std::string, i64, i64> Entry;
+    
+    bool operator () (Entry const &a, Entry const &b) const {
+        int compare = std::get<0>(a).compare(std::get<0>(b));
+        return 0 != compare ? compare < 0 : std::get<1>(a) < std::get<1>(b);
+    }
+};
+
+void CLowlaDBCursorImpl::performSortedQuery() {
+    if (0 < m_limit) {
+        performTopKQuery();
+        return;
+    }
+    
+    // The keys are stored back to back in one buffer; a stable sort keeps documents with equal keys
+    // in the order they were found. Past the memory budget the keys go to disk in sorted runs.
+    std::string arena;
+    std::vector<SortEntry> sortData;
+    
+    int rc, res;
+    rc = firstCandidate(&res);
+    while (SQLITE_OK == rc && 0 == res) {
+        CLowlaDBBsonImpl found(fetchCurrentDocument(), CLowlaDBBsonImpl::REF);
+        
+        if (matches(&found)) {
+            i64 id;
+            m_cursor->keySize(&id);
+            size_t offset = arena.size();
+            appendSortKey(&found, &arena);
+            sortData.push_back(std::make_tuple(offset, arena.size() - offset, id));
+            if (sortMemoryBudget < arena.size() + sortData.size() * sizeof(SortEntry)) {
+                spillSortRun(&arena, &sortData);
+            }
+        }
+        rc = nextCandidate(&res);
+    }
+    if (!m_sortRuns.empty()) {
+        if (!sortData.empty()) {
+            spillSortRun(&arena, &sortData);
+        }
+        for (size_t run = 0 ; run < m_sortRuns.size() ; ++run) {
+            rc = m_sortRuns[run].cursor->first(&res);
+            if (SQLITE_OK == rc && 0 == res) {
+                m_sortMerge.push_back(run);
+            }
+        }
+        m_walkSorted = m_sortedIds.end();
+        i64 skipped;
+        for (int skip = 0 ; skip < m_skip && nextMergedId(&skipped) ; ++skip) {
+        }
+        return;
+    }
+    const char *keys = arena.data();
+    std::stable_sort(sortData.begin(), sortData.end(), [keys](SortEntry const &a, SortEntry const &b) {
+        return lessSortEntry(keys, a, b);
+    });
+    if ((size_t)m_skip < sortData.size()) {
+        m_sortedIds.reserve(sortData.size() - m_skip);
+        for (auto walk = sortData.begin() + m_skip ; walk != sortData.end(); ++walk) {
+            m_sortedIds.push_back(std::get<2>(*walk));
+        }
+    }
+    m_walkSorted = m_sortedIds.begin();
+}
+
+// Sorts the keys gathered so far and writes them to a new temporary table
+void CLowlaDBCursorImpl::spillSortRun(std::string *arena, std::vector<SortEntry> *sortData) {
+    const char *keys = arena->data();
+    std::stable_sort(sortData->begin(), sortData->end(), [keys](SortEntry const &a, SortEntry const &b) {
+        return lessSortEntry(keys, a, b);
+    });
+    
+    SortRun run;
+    run.root = m_coll->db()->createSortTable();
+    run.cursor = m_coll->db()->openCursor(run.root, sortRunKeyInfo());
+    m_sortRuns.push_back(run);
+    
+    std::string key;
+    uint64_t position = 0;
+    for (SortEntry const &entry : *sortData) {
+        key.assign(keys + std::get<0>(entry), std::get<1>(entry));
+        appendBigEndian(&key, position++, 8);
+        appendBigEndian(&key, (uint64_t)std::get<2>(entry), 8);
+        int rc = run.cursor->insert(key.data(), key.size(), nullptr, 0, 0, true, 0);
+        if (SQLITE_OK != rc) {
+            throw TeamstudioException("Unable to write sort table, rc=" + utf16string::valueOf(rc));
+        }
+    }
+    arena->clear();
+    sortData->clear();
+}
+
+bool CLowlaDBCursorImpl::nextSortedId(int64_t *pId) {
+    if (m_walkSorted != m_sortedIds.end()) {
+        *pId = *m_walkSorted++;
+        return true;
+    }
+    return nextMergedId(pId);
+}
+
+// Takes the smallest key across the spilled runs; ties go to the earlier run to keep the sort stable
+bool CLowlaDBCursorImpl::nextMergedId(int64_t *pId) {
+    size_t best = m_sortMerge.size();
+    for (size_t i = 0 ; i < m_sortMerge.size() ; ++i) {
+        SortRun &run = m_sortRuns[m_sortMerge[i]];
+        if (run.key.empty()) {
+            readSortRunKey(run.cursor.get(), &run.key);
+        }
+        if (best == m_sortMerge.size()) {
+            best = i;
+            continue;
+        }
+        std::string const &bestKey = m_sortRuns[m_sortMerge[best]].key;
+        int compare = memcmp(run.key.data(), bestKey.data(), std::min(run.key.size(), bestKey.size()) - 16);
+        if (compare < 0 || (0 == compare && run.key.size() < bestKey.size())) {
+            best = i;
+        }
+    }
+    if (best == m_sortMerge.size()) {
+        return false;
+    }
+    SortRun &run = m_sortRuns[m_sortMerge[best]];
+    const unsigned char *idBytes = (const unsigned char *)run.key.data() + run.key.size() - 8;
+    uint64_t id = 0;
+    for (int i = 0 ; i < 8 ; ++i) {
+        id = (id << 8) | idBytes[i];
+    }
+    *pId = (int64_t)id;
+    
+    run.key.clear();
+    int res;
+    int rc = run.cursor->next(&res);
+    if (SQLITE_OK != rc || 0 != res) {
+        m_sortMerge.erase(m_sortMerge.begin() + best);
+    }
+    return true;
+}
+
+// The temporary tables vanish when our own transaction rolls back. Inside someone else's transaction
+// they have to be dropped, which sqlite only allows once every cursor is closed, starting with our own.
+void CLowlaDBCursorImpl::dropSortRuns() {
+    if (m_sortRuns.empty()) {
+        return;
+    }
+    for (SortRun &run : m_sortRuns) {
+        run.cursor->close();
+    }
+    if (m_tx && !m_tx->isOwnTx()) {
+        m_cursor.reset();
+        m_logCursor.reset();
+        m_indexCursor.reset();
+        for (SortRun const &run : m_sortRuns) {
+            m_coll->db()->releaseSortTable(run.root);
+        }
+    }
+    m_sortRuns.clear();
+    m_sortMerge.clear();
+}
+
+// With a limit only the first skip + limit documents can be returned, so keep those in a max-heap
+// and drop the largest whenever it overflows
+void CLowlaDBCursorImpl::performTopKQuery() {
+    TopKLess comp;
+    size_t keep = (size_t)m_skip + (size_t)m_limit;
+    std::vector<TopKLess::Entry> heap;
+    heap.reserve(keep + 1);
+    
+    i64 position = 0;
+    int rc, res;
+    rc = firstCandidate(&res);
+    while (SQLITE_OK == rc && 0 == res) {
+        CLowlaDBBsonImpl found(fetchCurrentDocument(), CLowlaDBBsonImpl::REF);
+        
+        if (matches(&found)) {
+            i64 id;
+            m_cursor->keySize(&id);
+            heap.push_back(TopKLess::Entry(std::string(), position++, id));
+            appendSortKey(&found, &std::get<0>(heap.back()));
+            if (heap.size() <= keep || comp(heap.back(), heap.front())) {
+                std::push_heap(heap.begin(), heap.end(), comp);
+                if (keep < heap.size()) {
+                    std::pop_heap(heap.begin(), heap.end(), comp);
+                    heap.pop_back();
+                }
+            }
+            else {
+                heap.pop_back();
+            }
+        }
+        rc = nextCandidate(&res);
+    }
+    std::sort_heap(heap.begin(), heap.end(), comp);
+    if ((size_t)m_skip < heap.size()) {
+        m_sortedIds.reserve(heap.size() - m_skip);
+        for (auto walk = heap.begin() + m_skip ; walk != heap.end() ; ++walk) {
+            m_sortedIds.push_back(std::get<2>(*walk));
+        }
+    }
+    m_walkSorted = m_sortedIds.begin();
+}
+
+void CLowlaDBCursorImpl::parseSortSpec()
+{
+    parseKeySpec(m_sort.get(), "sort", &m_parsedSort);
+}
+
+static bson_type locateDottedField(bson_iterator *it, CLowlaDBBsonImpl *doc, std::vector<utf16string> const &keys)
+{
+    bson_type answer = BSON_EOO;
+    bson_iterator_init(it, doc);
+    for (size_t i = 0 ; i < keys.size() - 1 ; ++i) {
+        const char *keystr = keys[i].c_str();
+        answer = bson_iterator_next(it);
+        while (BSON_EOO != answer) {
+            if (BSON_OBJECT == answer && 0 == strcmp(keystr, bson_iterator_key(it))) {
+                bson_iterator_subiterator(it, it);
+                break;
+            }
+            answer = bson_iterator_next(it);
+        }
+        if (BSON_EOO == answer) {
+            return answer;
+        }
+    }
+    const char *keystr = keys.back().c_str();
+    answer = bson_iterator_next(it);
+    while (BSON_EOO != answer) {
+        if (0 == strcmp(keystr, bson_iterator_key(it))) {
+            break;
+        }
+        answer = bson_iterator_next(it);
+    }
+    return answer;
+}
+
+// Appends the normalized sort key of a document; missing fields sort as null. As in MongoDB an array
+// sorts by its smallest element when ascending and its largest when descending, and an empty array
+// sorts as null.
+void CLowlaDBCursorImpl::appendSortKey(CLowlaDBBsonImpl *found, std::string *key) {
+    static const char nullValue[] = { 7, 0, 0, 0, BSON_NULL, 0, 0 };
+    
+    for (auto walk = m_parsedSort.begin() ; walk != m_parsedSort.end() ; ++walk) {
+        bson_iterator it[1];
+        bson_type type = locateDottedField(it, found, walk->first);
+        if (BSON_ARRAY == type) {
+            bson_iterator element[1];
+            bson_iterator_subiterator(it, element);
+            type = BSON_EOO;
+            while (BSON_EOO != bson_iterator_next(element)) {
+                if (BSON_EOO == type || 0 > compareBsonFields(element, it) * walk->second) {
+                    *it = *element;
+                    type = bson_iterator_type(it);
+                }
+            }
+        }
+        if (BSON_EOO == type) {
+            bson_iterator_from_buffer(it, nullValue);
+            bson_iterator_next(it);
+        }
+        appendNormalizedValue(key, it, -1 == walk->second);
+    }
+}
+
+IndexKey::IndexKey(const char *value, i64 recordId) : SqliteKey(recordId), m_value(value) {
+    bson_little_endian32(&m_cb, m_value);
+}
+
+KeyInfo *IndexKey::getKeyInfo() {
+    static KeyInfo keyInfo;
+    static CollSeq collSeq;
+    keyInfo.nField = 1;
+    keyInfo.aColl[0] = &collSeq;
+	keyInfo.aSortOrder = (u8 *)1;
+    collSeq.xCmp = IndexKey::compare;
+    return &keyInfo;
+}
+
+int IndexKey::compare(void *, int n1, const void *key1, int n2, const void *key2) {
+    const char *value1 = (const char *)key1;
+    const char *value2 = (const char *)key2;
+    bson_iterator it1[1];
+    bson_iterator it2[1];
+    bson_iterator_from_buffer(it1, value1);
+    bson_iterator_from_buffer(it2, value2);
+    while (true) {
+        bson_type type1 = bson_iterator_next(it1);
+        bson_type type2 = bson_iterator_next(it2);
+        if (BSON_EOO == type1 || BSON_EOO == type2) {
+            // A key that is a prefix of another sorts first so that seeks land on the first match
+            if (type1 != type2) {
+                return BSON_EOO == type1 ? -1 : +1;
+            }
+            break;
+        }
+        int answer = compareBsonFields(it1, it2);
+        if (0 != answer) {
+            return '-' == bson_iterator_key(it1)[0] ? -answer : answer;
+        }
+    }
+    i64 id1 = idFromKey(value1, n1);
+    i64 id2 = idFromKey(value2, n2);
+    return id1 < id2 ? -1 : (id2 < id1 ? +1 : 0);
+}
+
+bool IndexKey::hasPrefix(const char *key, const char *prefix) {
+    bson_iterator itKey[1];
+    bson_iterator itPrefix[1];
+    bson_iterator_from_buffer(itKey, key);
+    bson_iterator_from_buffer(itPrefix, prefix);
+    while (BSON_EOO != bson_iterator_next(itPrefix)) {
+        if (BSON_EOO == bson_iterator_next(itKey) || 0 != compareBsonFields(itKey, itPrefix)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+i64 IndexKey::idFromKey(const char *key, int cb) {
+    int valueSize;
+    bson_little_endian32(&valueSize, key);
+    u64 answer = 0;
+    if (valueSize < cb) {
+        sqlite3GetVarint((const unsigned char *)key + valueSize, &answer);
+    }
+    return (i64)answer;
+}
+
+int IndexKey::getSize() const {
+    return m_cb + getIdSize();
+}
+
+int IndexKey::writeToPointer(unsigned char *pc) {
+    memcpy(pc, m_value, m_cb);
+    sqlite3PutVarint(pc + m_cb, getId());
+    return getSize();
+}
+
+UnpackedRecord *IndexKey::newUnpackedRecord() {
+    UnpackedRecord* answer = (UnpackedRecord*)sqlite3_malloc(sizeof(UnpackedRecord) + sizeof(Mem) + getSize());
+    answer->nField = 1;
+    answer->pKeyInfo = IndexKey::getKeyInfo();
+	answer->default_rc = 0;
+    answer->aMem = (Mem*)(answer + 1);
+    answer->aMem->flags = 0;
+    answer->aMem->n = getSize();
+    answer->aMem->zMalloc = (char *)(answer->aMem + 1);
+    writeToPointer((unsigned char*)answer->aMem->zMalloc);
+    return answer;
+}
+
+void IndexKey::updateIdFromCursor(SqliteCursor *cursor) {
+    i64 size;
+    cursor->keySize(&size);
+    std::vector<char> key((size_t)size);
+    cursor->key(0, (u32)size, &key[0]);
+    setId(idFromKey(&key[0], (int)size));
+}
+
+CLowlaDBMatcher::Bounds::Bounds() : m_hasEquality(false), m_hasLower(false), m_lowerInclusive(false), m_hasUpper(false), m_upperInclusive(false) {
+}
+
+CLowlaDBMatcher::CLowlaDBMatcher(std::shared_ptr<CLowlaDBBsonImpl> query) : m_query(query) {
+}
+
+CLowlaDBMatcher::ptr CLowlaDBMatcher::compile(std::shared_ptr<CLowlaDBBsonImpl> query) {
+    CLowlaDBMatcher::ptr answer(new CLowlaDBMatcher(query));
+    bson_iterator it[1];
+    bson_iterator_init(it, query.get());
+    compileQuery(it, &answer->m_root);
+    return answer;
+}
+
+static bool isOperatorObject(bson_iterator *it) {
+    bson_iterator sub[1];
+    bson_iterator_subiterator(it, sub);
+    return BSON_EOO != bson_iterator_next(sub) && '$' == bson_iterator_key(sub)[0];
+}
+
+// Compiles the terms of a query document into the children of an AND node
+void CLowlaDBMatcher::compileQuery(bson_iterator *it, Node *node) {
+    node->m_type = AND;
+    while (BSON_EOO != bson_iterator_next(it)) {
+        const char *key = bson_iterator_key(it);
+        std::shared_ptr<Node> child = std::make_shared<Node>();
+        if (0 == strcmp("$and", key) || 0 == strcmp("$or", key)) {
+            if (BSON_ARRAY != bson_iterator_type(it)) {
+                throw TeamstudioException(utf16string(key) + " requires a nonempty array");
+            }
+            child->m_type = ('a' == key[1]) ? AND : OR;
+            bson_iterator sub[1];
+            bson_iterator_subiterator(it, sub);
+            while (BSON_EOO != bson_iterator_next(sub)) {
+                if (BSON_OBJECT != bson_iterator_type(sub)) {
+                    throw TeamstudioException(utf16string(key) + " entries must be objects");
+                }
+                std::shared_ptr<Node> term = std::make_shared<Node>();
+                bson_iterator termIt[1];
+                bson_iterator_subiterator(sub, termIt);
+                compileQuery(termIt, term.get());
+                child->m_children.push_back(term);
+            }
+            if (child->m_children.empty()) {
+                throw TeamstudioException(utf16string(key) + " requires a nonempty array");
+            }
+        }
+        else if ('$' == key[0]) {
+            throw TeamstudioException(utf16string("Unsupported query operator ") + key);
+        }
+        else {
+            child->m_type = FIELD;
+            child->m_path = splitDottedPath(key);
+            if (BSON_OBJECT == bson_iterator_type(it) && isOperatorObject(it)) {
+                compileConditions(it, &child->m_conditions);
+            }
+            else {
+                std::shared_ptr<Condition> condition = std::make_shared<Condition>();
+                condition->m_op = EQ;
+                condition->m_value = *it;
+                child->m_conditions.push_back(condition);
+            }
+        }
+        node->m_children.push_back(child);
+    }
+}
+
+static bool lessBsonValue(bson_iterator a, bson_iterator b) {
+    return compareBsonFields(&a, &b) < 0;
+}
+
+void CLowlaDBMatcher::compileConditions(bson_iterator *it, std::vector<std::shared_ptr<Condition>> *conditions) {
+    static const struct { const char *name; Op op; } operators[] = {
+        {"$eq", EQ}, {"$ne", NE}, {"$gt", GT}, {"$gte", GTE}, {"$lt", LT}, {"$lte", LTE},
+        {"$in", IN}, {"$nin", NIN}, {"$exists", EXISTS}, {"$not", NOT}
+    };
+    bson_iterator sub[1];
+    bson_iterator_subiterator(it, sub);
+    while (BSON_EOO != bson_iterator_next(sub)) {
+        const char *key = bson_iterator_key(sub);
+        std::shared_ptr<Condition> condition = std::make_shared<Condition>();
+        size_t i = 0;
+        while (i < sizeof(operators) / sizeof(operators[0]) && 0 != strcmp(operators[i].name, key)) {
+            ++i;
+        }
+        if (i == sizeof(operators) / sizeof(operators[0])) {
+            throw TeamstudioException(utf16string("Unsupported query operator ") + key);
+        }
+        condition->m_op = operators[i].op;
+        condition->m_value = *sub;
+        condition->m_valuesHaveNull = false;
+        condition->m_exists = false;
+        switch (condition->m_op) {
+            case IN:
+            case NIN: {
+                if (BSON_ARRAY != bson_iterator_type(sub)) {
+                    throw TeamstudioException(utf16string(key) + " requires an array");
+                }
+                // Sorted so that membership is a binary search
+                bson_iterator values[1];
+                bson_iterator_subiterator(sub, values);
+                while (BSON_EOO != bson_iterator_next(values)) {
+                    condition->m_values.push_back(*values);
+                    condition->m_valuesHaveNull = condition->m_valuesHaveNull || BSON_NULL == bson_iterator_type(values);
+                }
+                std::sort(condition->m_values.begin(), condition->m_values.end(), lessBsonValue);
+                break;
+            }
+            case EXISTS:
+                condition->m_exists = !!bson_iterator_bool(sub);
+                break;
+            case NOT:
+                if (BSON_OBJECT != bson_iterator_type(sub) || !isOperatorObject(sub)) {
+                    throw TeamstudioException("$not requires an operator object");
+                }
+                compileConditions(sub, &condition->m_conditions);
+                break;
+            default:
+                break;
+        }
+        conditions->push_back(condition);
+    }
+}
+
+bool CLowlaDBMatcher::matches(CLowlaDBBsonImpl *doc) {
+    return matchesNode(m_root, doc);
+}
+
+bool CLowlaDBMatcher::matchesNode(Node const &node, CLowlaDBBsonImpl *doc) {
+    switch (node.m_type) {
+        case AND:
+            for (std::shared_ptr<Node> const &child : node.m_children) {
+                if (!matchesNode(*child, doc)) {
+                    return false;
+                }
+            }
+            return true;
+        case OR:
+            for (std::shared_ptr<Node> const &child : node.m_children) {
+                if (matchesNode(*child, doc)) {
+                    return true;
+                }
+            }
+            return false;
+        case FIELD: {
+            bson_iterator it[1];
+            bool found = BSON_EOO != locateDottedField(it, doc, node.m_path);
+            for (std::shared_ptr<Condition> const &condition : node.m_conditions) {
+                if (!matchesCondition(*condition, found, it)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// Values compare as in a sort, so numbers of different types can be equal. Arrays are compared as
+// whole values, matching how they are indexed, and null matches a missing field.
+bool CLowlaDBMatcher::matchesCondition(Condition const &condition, bool found, bson_iterator *it) {
+    bson_iterator value = condition.m_value;
+    switch (condition.m_op) {
+        case EQ:
+        case NE: {
+            bool equal = found ? 0 == compareBsonFields(it, &value) : BSON_NULL == bson_iterator_type(&value);
+            return (EQ == condition.m_op) == equal;
+        }
+        case GT:
+        case GTE:
+        case LT:
+        case LTE: {
+            if (!found) {
+                // A missing field compares as null, as it does for $eq
+                return BSON_NULL == bson_iterator_type(&value) && (GTE == condition.m_op || LTE == condition.m_op);
+            }
+            if (canonicalBsonType(bson_iterator_type(it)) != canonicalBsonType(bson_iterator_type(&value))) {
+                return false;
+            }
+            int compare = compareBsonFields(it, &value);
+            switch (condition.m_op) {
+                case GT:
+                    return 0 < compare;
+                case GTE:
+                    return 0 <= compare;
+                case LT:
+                    return compare < 0;
+                default:
+                    return compare <= 0;
+            }
+        }
+        case IN:
+        case NIN: {
+            bool in = found ? std::binary_search(condition.m_values.begin(), condition.m_values.end(), *it, lessBsonValue) : condition.m_valuesHaveNull;
+            return (IN == condition.m_op) == in;
+        }
+        case EXISTS:
+            return found == condition.m_exists;
+        case NOT:
+            for (std::shared_ptr<Condition> const &sub : condition.m_conditions) {
+                if (!matchesCondition(*sub, found, it)) {
+                    return true;
+                }
+            }
+            return false;
+    }
+    return false;
+}
+
+CLowlaDBMatcher::Bounds CLowlaDBMatcher::boundsFor(std::vector<utf16string> const &path) {
+    Bounds answer;
+    collectBounds(m_root, path, &answer);
+    return answer;
+}
+
+// Only terms that every match must satisfy (those under AND nodes) can bound an index scan
+void CLowlaDBMatcher::collectBounds(Node const &node, std::vector<utf16string> const &path, Bounds *bounds) {
+    if (AND == node.m_type) {
+        for (std::shared_ptr<Node> const &child : node.m_children) {
+            collectBounds(*child, path, bounds);
+        }
+        return;
+    }
+    if (FIELD != node.m_type || node.m_path != path) {
+        return;
+    }
+    for (std::shared_ptr<Condition> const &condition : node.m_conditions) {
+        bson_iterator value = condition->m_value;
+        switch (condition->m_op) {
+            case EQ:
+                if (!bounds->m_hasEquality) {
+                    bounds->m_hasEquality = true;
+                    bounds->m_equality = value;
+                }
+                break;
+            case GT:
+            case GTE: {
+                bool inclusive = GTE == condition->m_op;
+                int compare = bounds->m_hasLower ? compareBsonFields(&value, &bounds->m_lower) : 1;
+                if (0 < compare || (0 == compare && !inclusive)) {
+                    bounds->m_hasLower = true;
+                    bounds->m_lower = value;
+                    bounds->m_lowerInclusive = inclusive;
+                }
+                break;
+            }
+            case LT:
+            case LTE: {
+                bool inclusive = LTE == condition->m_op;
+                int compare = bounds->m_hasUpper ? compareBsonFields(&value, &bounds->m_upper) : -1;
+                if (compare < 0 || (0 == compare && !inclusive)) {
+                    bounds->m_hasUpper = true;
+                    bounds->m_upper = value;
+                    bounds->m_upperInclusive = inclusive;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+}
+
+CLowlaDBProjection::CLowlaDBProjection() : m_inclusive(false), m_includeId(true) {
+}
+
+CLowlaDBProjection::ptr CLowlaDBProjection::compile(CLowlaDBBsonImpl *keys) {
+    CLowlaDBProjection::ptr answer(new CLowlaDBProjection());
+    bool idSpecified = false;
+    bool hasFields = false;
+    bson_iterator it[1];
+    bson_iterator_init(it, keys);
+    while (BSON_EOO != bson_iterator_next(it)) {
+        const char *key = bson_iterator_key(it);
+        bson_type type = bson_iterator_type(it);
+        if (BSON_OBJECT == type) {
+            throw TeamstudioException(utf16string("Unsupported projection operator for field: ") + key);
+        }
+        if (BSON_BOOL != type && BSON_INT != type && BSON_LONG != type && BSON_DOUBLE != type) {
+            throw TeamstudioException(utf16string("Invalid projection specification for field: ") + key);
+        }
+        bool include = !!bson_iterator_bool(it);
+        if (0 == strcmp("_id", key)) {
+            idSpecified = true;
+            answer->m_includeId = include;
+            continue;
+        }
+        if (!hasFields) {
+            hasFields = true;
+            answer->m_inclusive = include;
+        }
+        else if (answer->m_inclusive != include) {
+            throw TeamstudioException("Projection can not mix inclusion and exclusion");
+        }
+        
+        Node *node = &answer->m_root;
+        const char *segment = key;
+        while (true) {
+            const char *dot = strchr(segment, '.');
+            std::string name = dot ? std::string(segment, dot - segment) : std::string(segment);
+            std::shared_ptr<Node> &child = node->m_children[name];
+            if (!child) {
+                child = std::make_shared<Node>();
+            }
+            else if (child->m_children.empty()) {
+                // An enclosing path is already selected whole
+                break;
+            }
+            node = child.get();
+            if (!dot) {
+                node->m_children.clear();
+                break;
+            }
+            segment = dot + 1;
+        }
+    }
+    if (!hasFields) {
+        answer->m_inclusive = idSpecified && answer->m_includeId;
+    }
+    return answer;
+}
+
+void CLowlaDBProjection::apply(CLowlaDBBsonImpl *doc, CLowlaDBBsonImpl *answer) {
+    bson_iterator it[1];
+    bson_iterator_init(it, doc);
+    if (m_inclusive) {
+        if (m_includeId) {
+            answer->appendElement(doc, "_id");
+        }
+        includeFields(it, m_root, answer, true);
+    }
+    else {
+        excludeFields(it, m_root, answer, true);
+    }
+}
+
+void CLowlaDBProjection::includeFields(bson_iterator *it, Node const &node, CLowlaDBBsonImpl *answer, bool topLevel) {
+    while (BSON_EOO != bson_iterator_next(it)) {
+        const char *key = bson_iterator_key(it);
+        if (topLevel && 0 == strcmp("_id", key)) {
+            continue;
+        }
+        auto child = node.m_children.find(key);
+        if (child == node.m_children.end()) {
+            continue;
+        }
+        if (child->second->m_children.empty()) {
+            bson_append_element(answer, nullptr, it);
+        }
+        else {
+            includeValue(it, *child->second, key, answer);
+        }
+    }
+}
+
+// Copies the selected parts of a value that the projection descends into. Scalars have no parts, and
+// arrays keep only the parts of their objects.
+void CLowlaDBProjection::includeValue(bson_iterator *it, Node const &node, const char *key, CLowlaDBBsonImpl *answer) {
+    bson_type type = bson_iterator_type(it);
+    bson_iterator sub[1];
+    if (BSON_OBJECT == type) {
+        bson_iterator_subiterator(it, sub);
+        answer->startObject(key);
+        includeFields(sub, node, answer, false);
+        answer->finishObject();
+    }
+    else if (BSON_ARRAY == type) {
+        bson_iterator_subiterator(it, sub);
+        answer->startArray(key);
+        int i = 0;
+        while (BSON_EOO != bson_iterator_next(sub)) {
+            bson_type elementType = bson_iterator_type(sub);
+            if (BSON_OBJECT == elementType || BSON_ARRAY == elementType) {
+                char index[16];
+                bson_numstr(index, i++);
+                includeValue(sub, node, index, answer);
+            }
+        }
+        answer->finishArray();
+    }
+}
+
+void CLowlaDBProjection::excludeFields(bson_iterator *it, Node const &node, CLowlaDBBsonImpl *answer, bool topLevel) {
+    while (BSON_EOO != bson_iterator_next(it)) {
+        const char *key = bson_iterator_key(it);
+        if (topLevel && 0 == strcmp("_id", key)) {
+            if (m_includeId) {
+                bson_append_element(answer, nullptr, it);
+            }
+            continue;
+        }
+        auto child = node.m_children.find(key);
+        if (child == node.m_children.end()) {
+            bson_append_element(answer, nullptr, it);
+        }
+        else if (!child->second->m_children.empty()) {
+            excludeValue(it, *child->second, key, answer);
+        }
+    }
+}
+
+void CLowlaDBProjection::excludeValue(bson_iterator *it, Node const &node, const char *key, CLowlaDBBsonImpl *answer) {
+    bson_type type = bson_iterator_type(it);
+    bson_iterator sub[1];
+    if (BSON_OBJECT == type) {
+        bson_iterator_subiterator(it, sub);
+        answer->startObject(key);
+        excludeFields(sub, node, answer, false);
+        answer->finishObject();
+    }
+    else if (BSON_ARRAY == type) {
+        bson_iterator_subiterator(it, sub);
+        answer->startArray(key);
+        while (BSON_EOO != bson_iterator_next(sub)) {
+            excludeValue(sub, node, bson_iterator_key(sub), answer);
+        }
+        answer->finishArray();
+    }
+    else {
+        bson_append_element(answer, key, it);
+    }
+}
+
+CLowlaDBUpdater::Node::Node() : m_op(NONE), m_rename(0), m_creates(false) {
+}
+
+CLowlaDBUpdater::Op CLowlaDBUpdater::operatorFor(const char *name) {
+    static const std::map<std::string, Op> operators = {
+        { "$set", SET }, { "$unset", UNSET }, { "$inc", INC }, { "$mul", MUL }, { "$min", MIN }, { "$max", MAX },
+        { "$push", PUSH }, { "$addToSet", ADD_TO_SET }, { "$pull", PULL }, { "$rename", RENAME }
+    };
+    auto found = operators.find(name);
+    return found == operators.end() ? NONE : found->second;
+}
+
+bool CLowlaDBUpdater::isOperator(const char *name) {
+    return NONE != operatorFor(name);
+}
+
+CLowlaDBUpdater::ptr CLowlaDBUpdater::compile(CLowlaDBBsonImpl *update) {
+    CLowlaDBUpdater::ptr answer(new CLowlaDBUpdater());
+    bson_iterator it[1];
+    bson_iterator_init(it, update);
+    while (BSON_EOO != bson_iterator_next(it)) {
+        const char *key = bson_iterator_key(it);
+        Op op = operatorFor(key);
+        if (NONE == op) {
+            continue;
+        }
+        bson_iterator sub[1];
+        bson_iterator_subiterator(it, sub);
+        while (BSON_EOO != bson_iterator_next(sub)) {
+            answer->addOperation(op, key, sub);
+        }
+    }
+    return answer;
+}
+
+void CLowlaDBUpdater::addOperation(Op op, const char *opName, bson_iterator *field) {
+    const char *path = bson_iterator_key(field);
+    // The original _id is always kept
+    if (0 == strcmp("_id", path)) {
+        return;
+    }
+    bson_type type = bson_iterator_type(field);
+    switch (op) {
+        case INC:
+        case MUL:
+            if (BSON_INT != type && BSON_LONG != type && BSON_DOUBLE != type) {
+                throw TeamstudioException(utf16string("Cannot apply ") + opName + " with a non-numeric value for " + path);
+            }
+            break;
+        case RENAME: {
+            if (BSON_STRING != type || 0 == strcmp(path, bson_iterator_string(field))) {
+                throw TeamstudioException(utf16string("Invalid $rename target for ") + path);
+            }
+            addPath(path, false)->m_op = UNSET;
+            Node *target = addPath(bson_iterator_string(field), true);
+            target->m_op = RENAME;
+            target->m_rename = m_renameSources.size();
+            m_renameSources.push_back(splitDottedPath(path));
+            return;
+        }
+        default:
+            break;
+    }
+    
+    Node *node = addPath(path, UNSET != op && PULL != op);
+    node->m_op = op;
+    node->m_value = *field;
+    if (PUSH == op || ADD_TO_SET == op || PULL == op) {
+        bson_iterator sub[1];
+        if (PULL != op && BSON_OBJECT == type) {
+            bson_iterator_subiterator(field, sub);
+            if (BSON_EOO != bson_iterator_next(sub) && '$' == bson_iterator_key(sub)[0]) {
+                if (0 != strcmp("$each", bson_iterator_key(sub)) || BSON_ARRAY != bson_iterator_type(sub)) {
+                    throw TeamstudioException(utf16string("Unsupported ") + opName + " modifier for " + path);
+                }
+                bson_iterator_subiterator(sub, sub);
+                while (BSON_EOO != bson_iterator_next(sub)) {
+                    node->m_values.push_back(*sub);
+                }
+                return;
+            }
+        }
+        if (PULL == op && BSON_OBJECT == type && isOperatorObject(field)) {
+            throw TeamstudioException(utf16string("Unsupported $pull condition for ") + path);
+        }
+        node->m_values.push_back(*field);
+    }
+}
+
+CLowlaDBUpdater::Node *CLowlaDBUpdater::addPath(const char *path, bool creates) {
+    Node *node = &m_root;
+    const char *segment = path;
+    while (true) {
+        if (creates) {
+            node->m_creates = true;
+        }
+        const char *dot = strchr(segment, '.');
+        std::string name = dot ? std::string(segment, dot - segment) : std::string(segment);
+        if (name.empty()) {
+            throw TeamstudioException(utf16string("Invalid update path: ") + path);
+        }
+        auto found = node->m_childIndex.find(name);
+        if (found == node->m_childIndex.end()) {
+            node->m_childIndex[name] = node->m_children.size();
+            node->m_children.push_back(std::make_pair(name, std::make_shared<Node>()));
+            node = node->m_children.back().second.get();
+        }
+        else {
+            node = node->m_children[found->second].second.get();
+            if (NONE != node->m_op || !dot) {
+                throw TeamstudioException(utf16string("Update paths conflict at ") + path);
+            }
+        }
+        if (!dot) {
+            break;
+        }
+        segment = dot + 1;
+    }
+    if (creates) {
+        node->m_creates = true;
+    }
+    return node;
+}
+
+std::unique_ptr<CLowlaDBBsonImpl> CLowlaDBUpdater::apply(CLowlaDBBsonImpl *original) {
+    m_renamed.resize(m_renameSources.size());
+    m_renameFound.resize(m_renameSources.size());
+    for (size_t i = 0 ; i < m_renameSources.size() ; ++i) {
+        m_renameFound[i] = BSON_EOO != locateDottedField(&m_renamed[i], original, m_renameSources[i]);
+    }
+    std::unique_ptr<CLowlaDBBsonImpl> answer(new CLowlaDBBsonImpl());
+    answer->appendElement(original, "_id");
+    bson_iterator it[1];
+    bson_iterator_init(it, original);
+    applyFields(it, m_root, answer.get(), true, false);
+    answer->finish();
+    return answer;
+}
+
+static bool isArrayIndex(std::string const &key, int *pIndex) {
+    if (key.empty() || key.size() > 9 || std::string::npos != key.find_first_not_of("0123456789")) {
+        return false;
     }
+    *pIndex = atoi(key.c_str());
+    return true;
 }
 
-std::unique_ptr<CLowlaDBBsonImpl> CLowlaDBCursorImpl::nextUnsorted() {
-    int rc;
-    int res = 0;
-    if (!m_tx) {
-        m_tx.reset(new Tx(m_coll->db()->btree()));
-        m_cursor = m_coll->openCursor();
-        m_logCursor = m_coll->openLogCursor();
-        m_unsortedOffset = 0;
-        rc = m_cursor->first(&res);
-    }
-    else {
-        if (0 != m_limit && m_skip + m_limit < m_unsortedOffset) {
-            rc = m_cursor->last(&res);
+// Copies the fields under it, applying the children of node on the way, and then appends the children
+// that the fields didn't have
+void CLowlaDBUpdater::applyFields(bson_iterator *it, Node const &node, CLowlaDBBsonImpl *answer, bool topLevel, bool isArray) {
+    std::vector<bool> applied(node.m_children.size(), false);
+    int count = 0;
+    while (BSON_EOO != bson_iterator_next(it)) {
+        ++count;
+        const char *key = bson_iterator_key(it);
+        if (topLevel && 0 == strcmp("_id", key)) {
+            continue;
+        }
+        auto found = node.m_childIndex.find(key);
+        if (found == node.m_childIndex.end()) {
+            bson_append_element(answer, nullptr, it);
+            continue;
         }
-        rc = m_cursor->next(&res);
+        applied[found->second] = true;
+        applyValue(it, key, *node.m_children[found->second].second, answer, isArray);
     }
-    while (SQLITE_OK == res && 0 == rc) {
-        u32 size;
-        m_cursor->dataSize(&size);
-        char *data = (char *)bson_malloc(size);
-        m_cursor->data(0, size, data);
-        CLowlaDBBsonImpl found(data, CLowlaDBBsonImpl::OWN);
-        if (nullptr == m_query || matches(&found)) {
-            ++m_unsortedOffset;
-            if (m_skip < m_unsortedOffset && (0 == m_limit || m_unsortedOffset <= m_skip + m_limit)) {
-                i64 id;
-                m_cursor->keySize(&id);
-                std::unique_ptr<CLowlaDBBsonImpl> answer = project(&found, id);
-                return answer;
-            }
+    
+    std::vector<std::pair<int, size_t>> missingElements;
+    for (size_t i = 0 ; i < node.m_children.size() ; ++i) {
+        std::pair<std::string, std::shared_ptr<Node>> const &child = node.m_children[i];
+        if (applied[i] || !child.second->m_creates || !createsValue(*child.second)) {
+            continue;
+        }
+        if (!isArray) {
+            appendMissing(child.first.c_str(), *child.second, answer);
+            continue;
+        }
+        int index;
+        if (!isArrayIndex(child.first, &index)) {
+            throw TeamstudioException(utf16string("Can not create field ") + child.first.c_str() + " in an array");
         }
-        rc = m_cursor->next(&res);
+        missingElements.push_back(std::make_pair(index, i));
+    }
+    // New array elements go in index order, with nulls filling any gap
+    std::sort(missingElements.begin(), missingElements.end());
+    char numstr[16];
+    for (std::pair<int, size_t> const &element : missingElements) {
+        while (count < element.first) {
+            bson_numstr(numstr, count++);
+            answer->appendNull(numstr);
+        }
+        bson_numstr(numstr, count++);
+        appendMissing(numstr, *node.m_children[element.second].second, answer);
     }
-    return std::unique_ptr<CLowlaDBBsonImpl>();
 }
 
-std::unique_ptr<CLowlaDBBsonImpl> CLowlaDBCursorImpl::nextSorted() {
-    int rc;
-    int res = 0;
-    if (!m_tx) {
-        m_tx.reset(new Tx(m_coll->db()->btree()));
-        m_cursor = m_coll->openCursor();
-        m_logCursor = m_coll->openLogCursor();
-        performSortedQuery();
+void CLowlaDBUpdater::applyValue(bson_iterator *it, const char *key, Node const &node, CLowlaDBBsonImpl *answer, bool inArray) {
+    if (NONE != node.m_op) {
+        appendResult(key, node, it, answer, inArray);
+        return;
     }
-    
-    while (m_walkSorted != m_sortedIds.end()) {
-        i64 id = *m_walkSorted++;
-        rc = m_cursor->movetoUnpacked(nullptr, id, 1, &res);
-        if (SQLITE_OK != rc || 0 != res) {
-            continue;
+    bson_type type = bson_iterator_type(it);
+    if (BSON_OBJECT == type || BSON_ARRAY == type) {
+        bson_iterator sub[1];
+        bson_iterator_subiterator(it, sub);
+        if (BSON_OBJECT == type) {
+            answer->startObject(key);
         }
-        u32 size;
-        m_cursor->dataSize(&size);
-        char *data = (char *)bson_malloc(size);
-        m_cursor->data(0, size, data);
-        CLowlaDBBsonImpl found(data, CLowlaDBBsonImpl::OWN);
-        std::unique_ptr<CLowlaDBBsonImpl> answer = project(&found, id);
-        return answer;
+        else {
+            answer->startArray(key);
+        }
+        applyFields(sub, node, answer, false, BSON_ARRAY == type);
+        bson_append_finish_object(answer);
+    }
+    else if (node.m_creates) {
+        throw TeamstudioException(utf16string("Can not create fields in non-object field ") + key);
+    }
+    else {
+        bson_append_element(answer, nullptr, it);
     }
-    return std::unique_ptr<CLowlaDBBsonImpl>();
 }
 
-/* Compare two bson values using the algorithm described at http://docs.mongodb.org/master/reference/method/cursor.sort/#cursor.sort
- */
-static int compareBsonFields(bson_iterator *itA, bson_iterator *itB)
-{
-    static const int typeOrder[] = { BSON_MINKEY, BSON_NULL, BSON_INT, BSON_STRING, BSON_OBJECT, BSON_ARRAY, BSON_BINDATA, BSON_OID, BSON_BOOL, BSON_DATE, BSON_TIMESTAMP, BSON_REGEX, BSON_MAXKEY};
-    
-    int typeA = bson_iterator_type(itA);
-    int typeB = bson_iterator_type(itB);
+void CLowlaDBUpdater::appendMissing(const char *key, Node const &node, CLowlaDBBsonImpl *answer) {
+    if (NONE != node.m_op) {
+        appendResult(key, node, nullptr, answer, false);
+    }
+    else {
+        answer->startObject(key);
+        for (std::pair<std::string, std::shared_ptr<Node>> const &child : node.m_children) {
+            if (child.second->m_creates && createsValue(*child.second)) {
+                appendMissing(child.first.c_str(), *child.second, answer);
+            }
+        }
+        answer->finishObject();
+    }
+}
 
-    if (BSON_LONG == typeA || BSON_DOUBLE == typeA) {
-        typeA = BSON_INT;
+// Whether applying the node to a document that lacks its field would add one
+bool CLowlaDBUpdater::createsValue(Node const &node) {
+    switch (node.m_op) {
+        case NONE:
+            for (std::pair<std::string, std::shared_ptr<Node>> const &child : node.m_children) {
+                if (createsValue(*child.second)) {
+                    return true;
+                }
+            }
+            return false;
+        case RENAME:
+            return m_renameFound[node.m_rename];
+        default:
+            return node.m_creates;
     }
-    if (BSON_SYMBOL == typeA) {
-        typeA = BSON_STRING;
+}
+
+static void appendArithmetic(CLowlaDBBsonImpl *answer, const char *key, bool multiply, bson_iterator *value, bson_iterator *old) {
+    bson_type valueType = bson_iterator_type(value);
+    bson_type oldType = old ? bson_iterator_type(old) : valueType;
+    if (BSON_INT != oldType && BSON_LONG != oldType && BSON_DOUBLE != oldType) {
+        throw TeamstudioException(utf16string("Cannot apply ") + (multiply ? "$mul" : "$inc") + " to non-numeric field " + key);
     }
-    if (BSON_LONG == typeB || BSON_DOUBLE == typeB) {
-        typeB = BSON_INT;
+    if (BSON_DOUBLE == valueType || BSON_DOUBLE == oldType) {
+        double a = old ? bson_iterator_double(old) : 0;
+        double b = bson_iterator_double(value);
+        answer->appendDouble(key, multiply ? a * b : a + b);
+        return;
     }
-    if (BSON_SYMBOL == typeB) {
-        typeB = BSON_STRING;
+    int64_t a = old ? bson_iterator_long(old) : 0;
+    int64_t b = bson_iterator_long(value);
+    int64_t result = multiply ? a * b : a + b;
+    // Ints that overflow are promoted to longs
+    if (BSON_INT == valueType && BSON_INT == oldType && INT_MIN <= result && result <= INT_MAX) {
+        answer->appendInt(key, (int)result);
     }
-    if (typeA != typeB) {
-        const int *end = typeOrder + sizeof(typeOrder) / sizeof(int);
-        auto posA = std::find(typeOrder, end, typeA);
-        auto posB = std::find(typeOrder, end, typeB);
-        return posA < posB ? -1 : +1;
+    else {
+        answer->appendLong(key, result);
     }
-    switch (typeA) {
-        case BSON_MINKEY:
-        case BSON_NULL:
-        case BSON_MAXKEY:
-            return 0;
-        case BSON_INT: {
-            double dA = bson_iterator_double(itA);
-            double dB = bson_iterator_double(itB);
-            return dA < dB ? -1 : (dB < dA ? +1 : 0);
-        }
-        case BSON_STRING:
-            return strcmp(bson_iterator_string(itA), bson_iterator_string(itB));
-        case BSON_OBJECT: {
-            bson subA[1];
-            bson subB[1];
-            bson_iterator_subobject_init(itA, subA, false);
-            bson_iterator_subobject_init(itB, subB, false);
-            if (bson_size(subA) != bson_size(subB) ) {
-                return bson_size(subA) < bson_size(subB) ? -1 : +1;
-            }
-            return memcmp(bson_data(subA), bson_data(subB), bson_size(subA));
-        }
-        case BSON_ARRAY:
-            assert(false); // Arrays should have been replaced with their max/min value
+}
+
+// Appends the result of a leaf operation, given the value the field had before if it had one
+void CLowlaDBUpdater::appendResult(const char *key, Node const &node, bson_iterator *old, CLowlaDBBsonImpl *answer, bool inArray) {
+    bson_iterator value = node.m_value;
+    switch (node.m_op) {
+        case SET:
+            bson_append_element(answer, key, &value);
             break;
-        case BSON_BINDATA:
-            if (bson_iterator_bin_len(itA) != bson_iterator_bin_len(itB)) {
-                return bson_iterator_bin_len(itA) < bson_iterator_bin_len(itB) ? -1 : +1;
+        case UNSET:
+            // Removing an element would renumber the rest of the array so it is nulled instead
+            if (inArray) {
+                answer->appendNull(key);
             }
-            if (bson_iterator_bin_type(itA) != bson_iterator_bin_type(itB)) {
-                return bson_iterator_bin_type(itA) < bson_iterator_bin_type(itB) ? -1 : +1;
+            break;
+        case INC:
+        case MUL:
+            appendArithmetic(answer, key, MUL == node.m_op, &value, old);
+            break;
+        case MIN:
+        case MAX: {
+            bool replace = true;
+            if (old) {
+                int compare = compareBsonFields(&value, old);
+                replace = MIN == node.m_op ? compare < 0 : 0 < compare;
             }
-            return memcmp(bson_iterator_bin_data(itA), bson_iterator_bin_data(itB), bson_iterator_bin_len(itA));
-        case BSON_OID:
-            return memcmp(bson_iterator_oid(itA), bson_iterator_oid(itB), sizeof(bson_oid_t));
-        case BSON_BOOL:
-            if (!bson_iterator_bool(itA)) {
-                return bson_iterator_bool(itB) ? -1 : 0;
+            bson_append_element(answer, key, replace ? &value : old);
+            break;
+        }
+        case PUSH:
+        case ADD_TO_SET:
+        case PULL:
+            appendArrayResult(key, node, old, answer);
+            break;
+        case RENAME:
+            if (m_renameFound[node.m_rename]) {
+                bson_append_element(answer, key, &m_renamed[node.m_rename]);
             }
-            else {
-                return bson_iterator_bool(itB) ? 0 : +1;
+            else if (old) {
+                bson_append_element(answer, key, old);
             }
-        case BSON_DATE: {
-            bson_date_t dA = bson_iterator_date(itA);
-            bson_date_t dB = bson_iterator_date(itB);
-            return dA < dB ? -1 : (dA == dB ? 0 : +1);
-        }
-        case BSON_TIMESTAMP:
-        case BSON_REGEX:
-            assert(false); // We don't support these!
+            break;
+        case NONE:
             break;
     }
-    return 0;
 }
 
-class MyLess {
-public:
-    MyLess(std::vector<std::pair<std::vector<utf16string>, int>> const &parsedSort) {
-        for (auto walk = parsedSort.begin() ; walk != parsedSort.end() ; ++walk) {
-            m_asc.push_back(walk->second == 1);
-        }
-    }
-    
-    bool operator () (std::shared_ptr<CLowlaDBBsonImpl> const &a, std::shared_ptr<CLowlaDBBsonImpl> const &b) const {
-        bson_iterator itA[1];
-        bson_iterator itB[1];
-        
-        bson_iterator_init(itA, a.get());
-        bson_iterator_init(itB, b.get());
-        
-        int idx = 0;
-        int type = bson_iterator_next(itA);
-        while (BSON_EOO != type) {
-            int typeB = bson_iterator_next(itB);
-            assert(BSON_EOO != typeB);
-            int compare = compareBsonFields(itA, itB);
-            if (0 != compare) {
-                return (m_asc[idx] && compare < 0) || (!m_asc[idx] && 0 < compare);
-            }
-            ++idx;
-            type = bson_iterator_next(itA);
+static bool containsValue(std::vector<bson_iterator> const &values, bson_iterator const *value) {
+    for (bson_iterator const &walk : values) {
+        bson_iterator a = walk;
+        bson_iterator b = *value;
+        if (0 == compareBsonFields(&a, &b)) {
+            return true;
         }
-        return false;
     }
-    
-private:
-    std::vector<bool> m_asc;
-};
+    return false;
+}
 
-void CLowlaDBCursorImpl::performSortedQuery() {
-    parseSortSpec();
-    
-    MyLess comp(m_parsedSort);
-    std::multimap<std::shared_ptr<CLowlaDBBsonImpl>, i64, MyLess> sortData(comp);
-    
-    int rc, res;
-    rc = m_cursor->first(&res);
-    while (SQLITE_OK == rc && 0 == res) {
-        u32 size;
-        m_cursor->dataSize(&size);
-        char *data = (char *)bson_malloc(size);
-        m_cursor->data(0, size, data);
-        CLowlaDBBsonImpl found(data, CLowlaDBBsonImpl::OWN);
-        
-        if (nullptr == m_query || matches(&found)) {
-            i64 id;
-            m_cursor->keySize(&id);
-            std::shared_ptr<CLowlaDBBsonImpl> key = createSortKey(&found);
-            sortData.insert(std::pair<std::shared_ptr<CLowlaDBBsonImpl>, i64>(key, id));
-        }
-        rc = m_cursor->next(&res);
+void CLowlaDBUpdater::appendArrayResult(const char *key, Node const &node, bson_iterator *old, CLowlaDBBsonImpl *answer) {
+    if (old && BSON_ARRAY != bson_iterator_type(old)) {
+        throw TeamstudioException(utf16string("Cannot apply an array operation to non-array field ") + key);
+    }
+    if (!old && PULL == node.m_op) {
+        return;
     }
-    m_sortedIds.reserve(0 == m_limit ? sortData.size() - m_skip : m_limit);
-    auto walk = sortData.begin();
-    std::advance(walk, m_skip);
-    if (0 == m_limit) {
-        for ( ; walk != sortData.end(); ++walk) {
-            m_sortedIds.push_back(walk->second);
+    std::vector<bson_iterator> elements;
+    if (old) {
+        bson_iterator sub[1];
+        bson_iterator_subiterator(old, sub);
+        while (BSON_EOO != bson_iterator_next(sub)) {
+            if (PULL != node.m_op || !containsValue(node.m_values, sub)) {
+                elements.push_back(*sub);
+            }
         }
     }
-    else {
-        for (int limit = 0; walk != sortData.end() && limit < m_limit; ++walk, ++limit) {
-            m_sortedIds.push_back(walk->second);
+    if (PULL != node.m_op) {
+        for (bson_iterator const &value : node.m_values) {
+            if (PUSH == node.m_op || !containsValue(elements, &value)) {
+                elements.push_back(value);
+            }
         }
     }
-    m_walkSorted = m_sortedIds.begin();
+    answer->startArray(key);
+    char numstr[16];
+    for (size_t i = 0 ; i < elements.size() ; ++i) {
+        bson_numstr(numstr, (int)i);
+        bson_append_element(answer, numstr, &elements[i]);
+    }
+    answer->finishArray();
 }
 
-void CLowlaDBCursorImpl::parseSortSpec()
-{
-    bson_iterator it[1];
-    bson_iterator_init(it, m_sort.get());
-    bson_type walk = bson_iterator_next(it);
-    while (BSON_EOO != walk) {
-        int sortOrder = bson_iterator_int(it);
-        if (1 != sortOrder && -1 != sortOrder) {
-            throw TeamstudioException("Invalid sort specification: values must be +/- 1");
-        }
-        std::vector<utf16string> keys;
-        utf16string key(bson_iterator_key(it));
-        int startPos = 0;
-        int dotPos = key.indexOf('.');
-        while (-1 != dotPos) {
-            keys.push_back(key.substring(startPos, dotPos));
-            startPos = dotPos + 1;
-            dotPos = startPos < key.length() ? key.indexOf('.', startPos) : -1;
-        }
-        if (startPos < key.length()) {
-            keys.push_back(key.substring(startPos));
-        }
-        m_parsedSort.push_back(std::make_pair(keys, sortOrder));
-        
-        walk = bson_iterator_next(it);
-    }
+CLowlaDBIndexImpl::CLowlaDBIndexImpl(const char *keys, int root, bool multikey) : m_keys(new CLowlaDBBsonImpl(keys, CLowlaDBBsonImpl::COPY)), m_root(root), m_multikey(multikey) {
+    parseKeySpec(m_keys.get(), "index", &m_parsedKeys);
 }
 
-static bson_type locateDottedField(bson_iterator *it, CLowlaDBBsonImpl *doc, std::vector<utf16string> const &keys)
-{
-    bson_type answer = BSON_EOO;
-    bson_iterator_init(it, doc);
-    for (size_t i = 0 ; i < keys.size() - 1 ; ++i) {
-        const char *keystr = keys[i].c_str();
-        answer = bson_iterator_next(it);
-        while (BSON_EOO != answer) {
-            if (BSON_OBJECT == answer && 0 == strcmp(keystr, bson_iterator_key(it))) {
-                bson_iterator_subiterator(it, it);
-                break;
-            }
-            answer = bson_iterator_next(it);
-        }
-        if (BSON_EOO == answer) {
-            return answer;
-        }
+int CLowlaDBIndexImpl::root() {
+    return m_root;
+}
+
+CLowlaDBBsonImpl *CLowlaDBIndexImpl::keys() {
+    return m_keys.get();
+}
+
+bool CLowlaDBIndexImpl::hasKeys(CLowlaDBBsonImpl *keys) {
+    return keys->size() == m_keys->size() && 0 == memcmp(keys->data(), m_keys->data(), keys->size());
+}
+
+CLowlaDBKeySpec const &CLowlaDBIndexImpl::parsedKeys() {
+    return m_parsedKeys;
+}
+
+bool CLowlaDBIndexImpl::isMultikey() {
+    return m_multikey;
+}
+
+// Marks the index multikey if the key holds an array. Returns true only when that changes the index,
+// in which case the caller must save it to the collection header.
+bool CLowlaDBIndexImpl::noteArrayKey(CLowlaDBBsonImpl *key) {
+    if (m_multikey) {
+        return false;
     }
-    const char *keystr = keys.back().c_str();
-    answer = bson_iterator_next(it);
-    while (BSON_EOO != answer) {
-        if (0 == strcmp(keystr, bson_iterator_key(it))) {
-            break;
+    bson_iterator it[1];
+    bson_iterator_init(it, key);
+    while (BSON_EOO != bson_iterator_next(it)) {
+        if (BSON_ARRAY == bson_iterator_type(it)) {
+            m_multikey = true;
+            return true;
         }
-        answer = bson_iterator_next(it);
     }
-    return answer;
+    return false;
 }
 
-std::shared_ptr<CLowlaDBBsonImpl> CLowlaDBCursorImpl::createSortKey(CLowlaDBBsonImpl *found) {
-    
-    std::shared_ptr<CLowlaDBBsonImpl> answer(new CLowlaDBBsonImpl);
-    
-    for (auto walk = m_parsedSort.begin() ; walk != m_parsedSort.end() ; ++walk) {
+// Missing fields are indexed as null and arrays are indexed as a single value
+std::unique_ptr<CLowlaDBBsonImpl> CLowlaDBIndexImpl::createKey(CLowlaDBBsonImpl *doc) {
+    std::unique_ptr<CLowlaDBBsonImpl> answer(new CLowlaDBBsonImpl);
+    for (auto walk = m_parsedKeys.begin() ; walk != m_parsedKeys.end() ; ++walk) {
         bson_iterator it[1];
-        bson_type type = locateDottedField(it, found, walk->first);
+        bson_type type = locateDottedField(it, doc, walk->first);
         if (BSON_EOO == type) {
-            bson_append_null(answer.get(), "");
-        }
-        else if (BSON_ARRAY != type) {
-            bson_append_element(answer.get(), "", it);
+            bson_append_null(answer.get(), indexKeyName(walk->second));
         }
         else {
-            throw TeamstudioException("Internal error: array values not implemented for sort");
+            bson_append_element(answer.get(), indexKeyName(walk->second), it);
         }
     }
     answer->finish();
     return answer;
 }
 
+void CLowlaDBIndexImpl::insertEntry(SqliteCursor *cursor, CLowlaDBBsonImpl *key, int64_t id) {
+    IndexKey entry(key->data(), id);
+    int keySize = entry.getSize();
+    std::vector<unsigned char> data(keySize);
+    entry.writeToPointer(&data[0]);
+    int rc = cursor->insert(&data[0], keySize, nullptr, 0, 0, false, 0);
+    if (SQLITE_OK != rc) {
+        throw TeamstudioException("Unable to write index entry, rc=" + utf16string::valueOf(rc));
+    }
+}
+
+void CLowlaDBIndexImpl::removeEntry(SqliteCursor *cursor, CLowlaDBBsonImpl *key, int64_t id) {
+    IndexKey entry(key->data(), id);
+    int rc = cursor->deleteKey(&entry);
+    if (SQLITE_OK != rc) {
+        throw TeamstudioException("Unable to remove index entry, rc=" + utf16string::valueOf(rc));
+    }
+}
+
 SqliteCursor::ptr CLowlaDBCursorImpl::sqliteCursor() {
     return m_cursor;
 }
@@ -2184,36 +5369,97 @@ int64_t CLowlaDBCursorImpl::currentId() {
 
 
 bool CLowlaDBCursorImpl::matches(CLowlaDBBsonImpl *found) {
-    if (nullptr == m_query) {
-        return true;
-    }
-    bson_iterator it[1];
-    bson_iterator_init(it, m_query.get());
-    while (bson_iterator_next(it)) {
-        const char *key = bson_iterator_key(it);
-        if (!m_query->equalValues(key, found, key)) {
-            return false;
-        }
+    if (m_matcher && !m_matcher->matches(found)) {
+        return false;
     }
+    ++m_stats.documentsMatched;
     return true;
 }
 
+// Points straight into the page when the whole cell is stored there. Documents that spill onto
+// overflow pages are copied into the cursor's scratch buffer, which grows as needed and is reused
+// for every document. Either way the answer is only valid until the cursor moves.
+const char *CLowlaDBCursorImpl::fetchCurrentDocument() {
+    ++m_stats.documentsExamined;
+    u32 size;
+    m_cursor->dataSize(&size);
+    u32 available;
+    const char *data = (const char *)m_cursor->dataFetch(&available);
+    if (nullptr != data && size <= available) {
+        return data;
+    }
+    if (m_scratch.size() < size) {
+        m_scratch.resize(size);
+    }
+    m_cursor->data(0, size, &m_scratch[0]);
+    m_stats.bytesCopied += size;
+    return &m_scratch[0];
+}
+
+std::unique_ptr<CLowlaDBBsonImpl> CLowlaDBCursorImpl::explain() {
+    // Run a fresh copy of the cursor to completion so that this one is left untouched
+    CLowlaDBCursorImpl cursor(*this);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int64_t returned = 0;
+    while (cursor.next()) {
+        ++returned;
+    }
+    std::chrono::microseconds elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    
+    CLowlaDBQueryPlan::ptr plan = cursor.m_plan;
+    std::unique_ptr<CLowlaDBBsonImpl> answer(new CLowlaDBBsonImpl);
+    if (cursor.m_idLookupHit) {
+        answer->appendString("accessPath", "idLookup");
+    }
+    else if (plan->m_index) {
+        answer->appendString("accessPath", "indexScan");
+        answer->appendObject("index", plan->m_index->keys()->data());
+        answer->appendInt("equalityFields", (int)plan->m_equalityFields);
+        answer->appendBool("range", plan->m_rangeField);
+        answer->appendBool("reverse", plan->m_reverse);
+    }
+    else {
+        answer->appendString("accessPath", "collectionScan");
+    }
+    answer->appendBool("idLookupMissed", plan->m_idLookup && !cursor.m_idLookupHit);
+    answer->appendBool("planCached", cursor.m_planCached);
+    answer->appendString("sort", !m_sort ? "none" : (plan->m_ordered ? "index" : (0 < m_limit ? "topK" : "inMemory")));
+    answer->appendInt("sortRuns", (int)cursor.m_sortRuns.size());
+    answer->appendLong("entriesExamined", cursor.m_stats.entriesExamined);
+    answer->appendLong("documentsExamined", cursor.m_stats.documentsExamined);
+    answer->appendLong("documentsMatched", cursor.m_stats.documentsMatched);
+    answer->appendLong("documentsReturned", returned);
+    answer->appendLong("bytesCopied", cursor.m_stats.bytesCopied);
+    answer->appendLong("micros", elapsed.count());
+    answer->finish();
+    return answer;
+}
+
+bool CLowlaDBCursorImpl::needsProjection() {
+    return nullptr != m_keys || m_showDiskLoc || m_showPending;
+}
+
 std::unique_ptr<CLowlaDBBsonImpl> CLowlaDBCursorImpl::project(CLowlaDBBsonImpl *found, i64 id) {
-    if (nullptr == m_keys && !m_showDiskLoc && !m_showPending) {
+    if (!needsProjection()) {
         if (found->ownsData) {
             found->ownsData = false;
+            return std::unique_ptr<CLowlaDBBsonImpl>(new CLowlaDBBsonImpl(found->data(), CLowlaDBBsonImpl::OWN));
         }
-        std::unique_ptr<CLowlaDBBsonImpl> answer(new CLowlaDBBsonImpl(found->data(), CLowlaDBBsonImpl::OWN));
-        return answer;
+        // Documents read in place from the page have to be copied before the cursor moves on
+        m_stats.bytesCopied += found->size();
+        return std::unique_ptr<CLowlaDBBsonImpl>(new CLowlaDBBsonImpl(found->data(), CLowlaDBBsonImpl::COPY));
     }
     std::unique_ptr<CLowlaDBBsonImpl> answer(new CLowlaDBBsonImpl());
-    answer->appendElement(found, "_id");
-    bson_iterator it[1];
-    bson_iterator_init(it, found);
-    while (BSON_EOO != bson_iterator_next(it)) {
-        const char *key = bson_iterator_key(it);
-        if (nullptr == m_keys) {
-            if (0 != strcmp("_id", key)) {
+    if (m_projection) {
+        // Only the selected fields are copied out of the page
+        m_projection->apply(found, answer.get());
+    }
+    else {
+        answer->appendElement(found, "_id");
+        bson_iterator it[1];
+        bson_iterator_init(it, found);
+        while (BSON_EOO != bson_iterator_next(it)) {
+            if (0 != strcmp("_id", bson_iterator_key(it))) {
                 bson_append_element(answer.get(), nullptr, it);
             }
         }
@@ -2231,37 +5477,33 @@ std::unique_ptr<CLowlaDBBsonImpl> CLowlaDBCursorImpl::project(CLowlaDBBsonImpl *
         answer->appendBool("$pending", SQLITE_OK == rc && 0 == res);
     }
     answer->finish();
+    m_stats.bytesCopied += answer->size();
     return answer;
 }
 
 int64_t CLowlaDBCursorImpl::count() {
     if (!m_tx) {
-        m_tx.reset(new Tx(m_coll->db()->btree()));
-        m_cursor = m_coll->openCursor();
+        openCursors();
     }
     
     int rc;
     int res;
     i64 answer = 0;
     
-    rc = m_cursor->first(&res);
+    rc = firstCandidate(&res);
     if (nullptr == m_query) {
         answer = m_cursor->count();
     }
     else {
         while (SQLITE_OK == res && 0 == rc) {
-            u32 size;
-            m_cursor->dataSize(&size);
-            char *data = (char *)bson_malloc(size);
-            m_cursor->data(0, size, data);
-            CLowlaDBBsonImpl found(data, CLowlaDBBsonImpl::OWN);
+            CLowlaDBBsonImpl found(fetchCurrentDocument(), CLowlaDBBsonImpl::REF);
             if (matches(&found)) {
                 ++answer;
                 if (0 != m_limit && m_skip + m_limit <= answer) {
                     break;
                 }
             }
-            rc = m_cursor->next(&res);
+            rc = nextCandidate(&res);
         }
     }
     if (answer <= m_skip) {
@@ -2577,10 +5819,27 @@ utf16string lowladb_get_version() {
     return "0.0.2";
 }
 
+void lowladb_set_sort_memory_budget(size_t bytes) {
+    sortMemoryBudget = bytes;
+}
+
 void lowladb_db_delete(const utf16string &name) {
     utf16string filePath = getFullPath(name);
 
+    // Handles still held elsewhere keep working on the removed file, but the next open starts afresh
+    sqlite3_mutex_enter(dbPoolMutex());
+    std::vector<CPooledDb> &pool = dbPool();
+    pool.erase(std::remove_if(pool.begin(), pool.end(), [&name](CPooledDb const &pooled) {
+        return pooled.name == name;
+    }), pool.end());
     remove(filePath.c_str());
+    sqlite3_mutex_leave(dbPoolMutex());
+}
+
+void lowladb_close_idle_databases() {
+    sqlite3_mutex_enter(dbPoolMutex());
+    closeIdleDatabases(true);
+    sqlite3_mutex_leave(dbPoolMutex());
 }
 
 CLowlaDBPullData::ptr lowladb_parse_syncer_response(const char *bsonData) {
@@ -2677,7 +5936,7 @@ void processLeadingDeletions(CLowlaDBPullDataImpl *pullData, CLowlaDBNsCache &ca
                 std::unique_ptr<CLowlaDBSyncDocumentLocation> loc = coll->locateDocumentForId(id);
                 // We only process the deletion if there is no outgoing record
                 if (!loc->m_logFound && loc->m_found) {
-                    loc->m_cursor->deleteCurrent();
+                    coll->deleteDocument(loc->m_cursor.get(), loc->m_sqliteId, loc->m_found.get());
                 }
             }
             walk = pullData->eraseAtom(walk);
@@ -2732,7 +5991,7 @@ void lowladb_apply_pull_response(const std::vector<CLowlaDBBson::ptr> &response,
         }
         if (isDeletion) {
             if (loc->m_found) {
-                loc->m_cursor->deleteCurrent();
+                coll->deleteDocument(loc->m_cursor.get(), loc->m_sqliteId, loc->m_found.get());
             }
         }
         else {
@@ -2849,7 +6108,7 @@ void lowladb_apply_push_response(std::vector<CLowlaDBBson::ptr> &response, CLowl
         }
         if (isDeletion) {
             if (loc->m_found) {
-                loc->m_cursor->deleteCurrent();
+                coll->deleteDocument(loc->m_cursor.get(), loc->m_sqliteId, loc->m_found.get());
             }
         }
         else {
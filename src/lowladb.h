@@ -109,6 +109,12 @@ public:
     CLowlaDBWriteResult::ptr remove(const char *queryBson);
     CLowlaDBWriteResult::ptr save(const char *bsonData);
     CLowlaDBWriteResult::ptr update(const char *queryBson, const char *objectBson, bool upsert, bool multi);
+    // Returns the document as it was before the update or removal, or after it if returnNew is set. Returns
+    // null if nothing matched and no document was upserted.
+    CLowlaDBBson::ptr findAndModify(const char *queryBson, const char *updateBson, const char *sortBson, bool returnNew, bool upsert, bool remove);
+    
+    void ensureIndex(const char *keysBson);
+    void dropIndex(const char *keysBson);
     
 private:
     std::shared_ptr<CLowlaDBCollectionImpl> m_pimpl;
@@ -127,6 +133,11 @@ public:
     
     CLowlaDBCollection::ptr createCollection(const utf16string &name);
     void collectionNames(std::vector<utf16string> *plstNames);
+    // Frees the collection's pages, including its unsynced changes. Collection objects already
+    // obtained for it, and cursors on them, must not be used afterwards.
+    void dropCollection(const utf16string &name);
+    // Collection objects already obtained for it pick up the new name on their next operation
+    void renameCollection(const utf16string &from, const utf16string &to);
     
 private:
     std::shared_ptr<CLowlaDBImpl> m_pimpl;
@@ -134,6 +145,10 @@ private:
     CLowlaDB(std::shared_ptr<CLowlaDBImpl> pimpl);
 };
 
+// Receives a document borrowed from the database, valid only for the duration of the call. Return
+// false to stop the traversal.
+typedef bool (*LowlaDbDocumentCallback)(void *user, const char *bson, size_t size);
+
 class CLowlaDBCursor {
 public:
     typedef std::shared_ptr<CLowlaDBCursor> ptr;
@@ -142,13 +157,20 @@ public:
     std::shared_ptr<CLowlaDBCursorImpl> pimpl();
 
     static CLowlaDBCursor::ptr create(CLowlaDBCollection::ptr coll, const char *query);
+    static CLowlaDBCursor::ptr create(CLowlaDBCollection::ptr coll, const char *query, const char *keys);
     CLowlaDBCursor::ptr limit(int limit);
     CLowlaDBCursor::ptr skip(int skip);
     CLowlaDBCursor::ptr sort(const char *sort);
     CLowlaDBCursor::ptr showPending();
     
     CLowlaDBBson::ptr next();
+    // Fills buffer with up to n concatenated documents and offsets with where each one starts.
+    // Returns the number of documents, which is zero when the cursor is exhausted.
+    size_t nextBatch(size_t n, std::vector<char> *buffer, std::vector<size_t> *offsets);
+    // Calls back with each remaining document and returns how many were visited
+    int64_t forEach(LowlaDbDocumentCallback callback, void *user);
     int64_t count();
+    CLowlaDBBson::ptr explain();
     
 private:
     std::shared_ptr<CLowlaDBCursorImpl> m_pimpl;
@@ -191,6 +213,9 @@ private:
 utf16string lowladb_get_version();
 void lowladb_list_databases(std::vector<utf16string> *plstdb);
 void lowladb_db_delete(const utf16string &name);
+// Closes pooled database handles that are not in use, to release their page caches
+void lowladb_close_idle_databases();
+void lowladb_set_sort_memory_budget(size_t bytes);
 
 CLowlaDBPullData::ptr lowladb_parse_syncer_response(const char *bson);
 CLowlaDBPushData::ptr lowladb_collect_push_data();
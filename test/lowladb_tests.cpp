@@ -6,6 +6,7 @@
 //  Copyright (c) 2014 Lowla. All rights reserved.
 //
 
+#include <algorithm>
 #include <fstream>
 
 #include "gtest.h"
@@ -928,6 +929,1150 @@ TEST_F(DbTestFixture, test_cursor_show_pending) {
     EXPECT_FALSE(cursor->next());
 }
 
+static void insertAB(CLowlaDBCollection::ptr coll, int a, int b) {
+    CLowlaDBBson::ptr bson = CLowlaDBBson::create();
+    bson->appendInt("a", a);
+    bson->appendInt("b", b);
+    bson->finish();
+    coll->insert(bson->data());
+}
+
+static std::vector<int> findB(CLowlaDBCollection::ptr coll, int a) {
+    CLowlaDBBson::ptr query = CLowlaDBBson::create();
+    query->appendInt("a", a);
+    query->finish();
+    std::vector<int> answer;
+    CLowlaDBCursor::ptr cursor = CLowlaDBCursor::create(coll, query->data());
+    CLowlaDBBson::ptr doc = cursor->next();
+    while (doc) {
+        int val;
+        EXPECT_TRUE(doc->intForKey("b", &val));
+        answer.push_back(val);
+        doc = cursor->next();
+    }
+    return answer;
+}
+
+TEST_F(DbTestFixture, test_index_equality_query) {
+    insertAB(coll, 1, 10);
+    insertAB(coll, 2, 20);
+    insertAB(coll, 2, 30);
+    
+    CLowlaDBBson::ptr keys = CLowlaDBBson::create();
+    keys->appendInt("a", 1);
+    keys->finish();
+    coll->ensureIndex(keys->data());
+    
+    EXPECT_EQ(std::vector<int>({20, 30}), findB(coll, 2));
+    EXPECT_EQ(std::vector<int>(), findB(coll, 3));
+    
+    // The index must follow inserts, updates and removes
+    insertAB(coll, 3, 40);
+    CLowlaDBBson::ptr query = CLowlaDBBson::create();
+    query->appendInt("b", 20);
+    query->finish();
+    CLowlaDBBson::ptr update = CLowlaDBBson::create();
+    update->startObject("$set");
+    update->appendInt("a", 3);
+    update->finishObject();
+    update->finish();
+    coll->update(query->data(), update->data(), false, false);
+    query = CLowlaDBBson::create();
+    query->appendInt("a", 1);
+    query->finish();
+    coll->remove(query->data());
+    
+    EXPECT_EQ(std::vector<int>(), findB(coll, 1));
+    EXPECT_EQ(std::vector<int>({30}), findB(coll, 2));
+    EXPECT_EQ(std::vector<int>({20, 40}), findB(coll, 3));
+    
+    query = CLowlaDBBson::create();
+    query->appendInt("a", 3);
+    query->finish();
+    EXPECT_EQ(2, CLowlaDBCursor::create(coll, query->data())->count());
+}
+
+TEST_F(DbTestFixture, test_index_drop) {
+    insertAB(coll, 1, 10);
+    insertAB(coll, 2, 20);
+    
+    CLowlaDBBson::ptr keys = CLowlaDBBson::create();
+    keys->appendInt("a", 1);
+    keys->appendInt("b", -1);
+    keys->finish();
+    coll->ensureIndex(keys->data());
+    coll->ensureIndex(keys->data());
+    EXPECT_EQ(std::vector<int>({20}), findB(coll, 2));
+    
+    coll->dropIndex(keys->data());
+    EXPECT_EQ(std::vector<int>({20}), findB(coll, 2));
+    EXPECT_THROW(coll->dropIndex(keys->data()), TeamstudioException);
+    
+    keys = CLowlaDBBson::create();
+    keys->appendInt("a", 2);
+    keys->finish();
+    EXPECT_THROW(coll->ensureIndex(keys->data()), TeamstudioException);
+}
+
+TEST_F(DbTestFixture, test_index_maintained_by_other_handles) {
+    CLowlaDBBson::ptr keys = CLowlaDBBson::create();
+    keys->appendInt("a", 1);
+    keys->finish();
+    coll->ensureIndex(keys->data());
+    
+    CLowlaDB::ptr db2 = CLowlaDB::open("mydb");
+    CLowlaDBCollection::ptr coll2 = db2->createCollection("mycoll");
+    insertAB(coll2, 5, 50);
+    
+    EXPECT_EQ(std::vector<int>({50}), findB(coll, 5));
+}
+
+TEST_F(DbTestFixture, test_open_reuses_pooled_handle) {
+    insertAB(coll, 1, 10);
+    
+    // A handle is only used by one caller at a time, so their transactions stay apart
+    CLowlaDB::ptr db2 = CLowlaDB::open("mydb");
+    EXPECT_NE(db->pimpl(), db2->pimpl());
+    
+    // Once released it is handed out again, warm cache and all
+    CLowlaDBImpl *pooled = db2->pimpl().get();
+    db2.reset();
+    db2 = CLowlaDB::open("mydb");
+    EXPECT_EQ(pooled, db2->pimpl().get());
+    EXPECT_NE(pooled, CLowlaDB::open("mydb")->pimpl().get());
+    db2.reset();
+    EXPECT_EQ(std::vector<int>({10}), findB(CLowlaDB::open("mydb")->createCollection("mycoll"), 1));
+    
+    lowladb_db_delete("mydb");
+    db2 = CLowlaDB::open("mydb");
+    EXPECT_EQ(0, CLowlaDBCursor::create(db2->createCollection("mycoll"), nullptr)->count());
+}
+
+TEST_F(DbTestFixture, test_drop_collection) {
+    CLowlaDBCollection::ptr coll2 = db->createCollection("coll2");
+    CLowlaDBCollection::ptr coll3 = db->createCollection("coll3");
+    CLowlaDBBson::ptr keys = CLowlaDBBson::create();
+    keys->appendInt("a", 1);
+    keys->finish();
+    coll2->ensureIndex(keys->data());
+    coll3->ensureIndex(keys->data());
+    insertAB(coll2, 1, 10);
+    insertAB(coll3, 1, 30);
+    
+    db->dropCollection("coll2");
+    std::vector<utf16string> lstNames;
+    db->collectionNames(&lstNames);
+    EXPECT_EQ(std::vector<utf16string>({"mycoll", "coll3"}), lstNames);
+    
+    // Under autovacuum coll3's tables move into the pages coll2 freed; the existing object follows them
+    EXPECT_EQ(std::vector<int>({30}), findB(coll3, 1));
+    insertAB(coll3, 1, 40);
+    EXPECT_EQ(std::vector<int>({30, 40}), findB(coll3, 1));
+    EXPECT_EQ(std::vector<int>({30, 40}), findB(db->createCollection("coll3"), 1));
+    EXPECT_EQ(0, CLowlaDBCursor::create(db->createCollection("coll2"), nullptr)->count());
+    EXPECT_THROW(db->dropCollection("missing"), TeamstudioException);
+}
+
+TEST_F(DbTestFixture, test_create_collection_sees_other_handles) {
+    EXPECT_EQ(0, CLowlaDBCursor::create(db->createCollection("coll2"), nullptr)->count());
+    
+    CLowlaDB::ptr db2 = CLowlaDB::open("mydb");
+    db2->dropCollection("coll2");
+    insertAB(db2->createCollection("coll2"), 1, 10);
+    EXPECT_EQ(std::vector<int>({10}), findB(db->createCollection("coll2"), 1));
+    
+    db2->renameCollection("coll2", "coll3");
+    EXPECT_EQ(0, CLowlaDBCursor::create(db->createCollection("coll2"), nullptr)->count());
+    EXPECT_EQ(std::vector<int>({10}), findB(db->createCollection("coll3"), 1));
+}
+
+TEST_F(DbTestFixture, test_rename_collection) {
+    insertAB(coll, 1, 10);
+    db->createCollection("coll2");
+    
+    EXPECT_THROW(db->renameCollection("mycoll", "coll2"), TeamstudioException);
+    EXPECT_THROW(db->renameCollection("missing", "coll3"), TeamstudioException);
+    db->renameCollection("mycoll", "renamed");
+    std::vector<utf16string> lstNames;
+    db->collectionNames(&lstNames);
+    EXPECT_EQ(std::vector<utf16string>({"renamed", "coll2"}), lstNames);
+    EXPECT_EQ(std::vector<int>({10}), findB(db->createCollection("renamed"), 1));
+    
+    // Collection objects from before the rename follow it
+    CLowlaDBBson::ptr keys = lowladb_json_to_bson("{\"a\" : 1}");
+    coll->ensureIndex(keys->data());
+    insertAB(coll, 1, 20);
+    EXPECT_EQ(std::vector<int>({10, 20}), findB(db->createCollection("renamed"), 1));
+}
+
+TEST_F(DbTestFixture, test_insert_from_interleaved_handles) {
+    // Each connection caches its next record id, so neither may overwrite the other's documents
+    CLowlaDB::ptr db2 = CLowlaDB::open("mydb");
+    CLowlaDBCollection::ptr coll2 = db2->createCollection("mycoll");
+    for (int i = 0 ; i < 10 ; ++i) {
+        insertAB(coll, 1, i);
+        insertAB(coll2, 2, i);
+        insertAB(coll2, 2, i + 100);
+    }
+    EXPECT_EQ(30, CLowlaDBCursor::create(coll, nullptr)->count());
+    EXPECT_EQ(10, findB(coll, 1).size());
+    EXPECT_EQ(20, findB(coll2, 2).size());
+}
+
+TEST_F(DbTestFixture, test_find_by_id) {
+    // Enough documents that the later record ids need multi-byte varints
+    for (int i = 0 ; i < 200 ; ++i) {
+        CLowlaDBBson::ptr bson = CLowlaDBBson::create();
+        bson->appendString("_id", utf16string::valueOf(i).c_str());
+        bson->appendInt("a", i);
+        bson->finish();
+        coll->insert(bson->data());
+    }
+    
+    CLowlaDBBson::ptr query = CLowlaDBBson::create();
+    query->appendString("_id", "150");
+    query->finish();
+    CLowlaDBCursor::ptr cursor = CLowlaDBCursor::create(coll, query->data());
+    CLowlaDBBson::ptr doc = cursor->next();
+    int val;
+    ASSERT_TRUE(!!doc);
+    EXPECT_TRUE(doc->intForKey("a", &val));
+    EXPECT_EQ(150, val);
+    EXPECT_FALSE(cursor->next());
+    
+    query = CLowlaDBBson::create();
+    query->appendString("_id", "150");
+    query->appendInt("a", 151);
+    query->finish();
+    EXPECT_FALSE(CLowlaDBCursor::create(coll, query->data())->next());
+    
+    query = CLowlaDBBson::create();
+    query->appendString("_id", "500");
+    query->finish();
+    EXPECT_FALSE(CLowlaDBCursor::create(coll, query->data())->next());
+}
+
+TEST_F(DbTestFixture, test_find_by_id_of_pulled_document) {
+    pullTestDocument();
+    
+    CLowlaDBBson::ptr query = CLowlaDBBson::create();
+    query->appendString("_id", "1234");
+    query->finish();
+    CLowlaDBCursor::ptr cursor = CLowlaDBCursor::create(coll, query->data());
+    CLowlaDBBson::ptr doc = cursor->next();
+    const char *val;
+    ASSERT_TRUE(!!doc);
+    EXPECT_TRUE(doc->stringForKey("myfield", &val));
+    EXPECT_STREQ("mystring", val);
+    EXPECT_FALSE(cursor->next());
+}
+
+TEST_F(DbTestFixture, test_find_by_id_after_batch_insert_and_remove) {
+    std::vector<CLowlaDBBson::ptr> docs;
+    std::vector<const char *> arr;
+    for (int i = 0 ; i < 300 ; ++i) {
+        CLowlaDBBson::ptr bson = CLowlaDBBson::create();
+        bson->appendString("_id", utf16string::valueOf(i * 7919 % 1000).c_str());
+        bson->appendInt("a", i % 2);
+        bson->finish();
+        docs.push_back(bson);
+        arr.push_back(bson->data());
+    }
+    coll->insert(arr);
+    
+    CLowlaDBBson::ptr query = CLowlaDBBson::create();
+    query->appendInt("a", 1);
+    query->finish();
+    CLowlaDBWriteResult::ptr wr = coll->remove(query->data());
+    EXPECT_EQ(150, wr->documentCount());
+    
+    for (int i = 0 ; i < 300 ; ++i) {
+        CLowlaDBBson::ptr idQuery = CLowlaDBBson::create();
+        idQuery->appendString("_id", utf16string::valueOf(i * 7919 % 1000).c_str());
+        idQuery->finish();
+        CLowlaDBBson::ptr found = CLowlaDBCursor::create(coll, idQuery->data())->next();
+        EXPECT_EQ(0 == i % 2, !!found);
+    }
+}
+
+TEST_F(DbTestFixture, test_index_provides_sort_order) {
+    insertAB(coll, 2, 20);
+    insertAB(coll, 1, 30);
+    insertAB(coll, 2, 10);
+    insertAB(coll, 3, 40);
+    insertAB(coll, 2, 30);
+    
+    CLowlaDBBson::ptr keys = CLowlaDBBson::create();
+    keys->appendInt("a", 1);
+    keys->appendInt("b", 1);
+    keys->finish();
+    coll->ensureIndex(keys->data());
+    
+    // Equality on a, sorted by b in both directions
+    CLowlaDBBson::ptr query = CLowlaDBBson::create();
+    query->appendInt("a", 2);
+    query->finish();
+    std::vector<int> expected = {10, 20, 30};
+    for (int direction : {1, -1}) {
+        CLowlaDBBson::ptr sort = CLowlaDBBson::create();
+        sort->appendInt("b", direction);
+        sort->finish();
+        CLowlaDBCursor::ptr cursor = CLowlaDBCursor::create(coll, query->data())->sort(sort->data());
+        std::vector<int> found;
+        for (CLowlaDBBson::ptr doc = cursor->next() ; doc ; doc = cursor->next()) {
+            int val;
+            EXPECT_TRUE(doc->intForKey("b", &val));
+            found.push_back(val);
+        }
+        EXPECT_EQ(expected, found);
+        std::reverse(expected.begin(), expected.end());
+    }
+    
+    // Whole collection in descending index order with skip and limit
+    CLowlaDBBson::ptr sort = CLowlaDBBson::create();
+    sort->appendInt("a", -1);
+    sort->appendInt("b", -1);
+    sort->finish();
+    CLowlaDBCursor::ptr cursor = CLowlaDBCursor::create(coll, nullptr)->sort(sort->data())->skip(1)->limit(3);
+    std::vector<int> found;
+    for (CLowlaDBBson::ptr doc = cursor->next() ; doc ; doc = cursor->next()) {
+        int val;
+        EXPECT_TRUE(doc->intForKey("b", &val));
+        found.push_back(val);
+    }
+    EXPECT_EQ(std::vector<int>({30, 20, 10}), found);
+}
+
+TEST_F(DbTestFixture, test_sort_on_array_field_uses_elements) {
+    const char *docs[] = {
+        "{\"b\" : 1, \"a\" : [3, 1]}",
+        "{\"b\" : 2, \"a\" : 5}",
+        "{\"b\" : 3, \"a\" : [2]}",
+        "{\"b\" : 4, \"a\" : [2, 0]}",
+        "{\"b\" : 5, \"a\" : []}",
+        "{\"b\" : 6}"
+    };
+    for (const char *json : docs) {
+        coll->insert(lowladb_json_to_bson(json)->data());
+    }
+    
+    // Smallest element ascending, largest descending; an index can't give that order so it isn't used
+    for (int pass = 0 ; pass < 2 ; ++pass) {
+        if (1 == pass) {
+            coll->ensureIndex(lowladb_json_to_bson("{\"a\" : 1}")->data());
+        }
+        for (int direction : {1, -1}) {
+            CLowlaDBBson::ptr sort = CLowlaDBBson::create();
+            sort->appendInt("a", direction);
+            sort->finish();
+            CLowlaDBCursor::ptr cursor = CLowlaDBCursor::create(coll, nullptr)->sort(sort->data());
+            std::vector<int> found;
+            for (CLowlaDBBson::ptr doc = cursor->next() ; doc ; doc = cursor->next()) {
+                int val;
+                EXPECT_TRUE(doc->intForKey("b", &val));
+                found.push_back(val);
+            }
+            EXPECT_EQ(1 == direction ? std::vector<int>({5, 6, 4, 1, 3, 2}) : std::vector<int>({2, 1, 3, 4, 5, 6}), found);
+            CLowlaDBBson::ptr explain = cursor->explain();
+            const char *path;
+            EXPECT_TRUE(explain->stringForKey("accessPath", &path));
+            EXPECT_STREQ("collectionScan", path);
+        }
+    }
+    
+    // An index only stops providing the order once an array is written to it
+    CLowlaDBCollection::ptr other = db->createCollection("coll2");
+    other->ensureIndex(lowladb_json_to_bson("{\"a\" : 1}")->data());
+    other->insert(lowladb_json_to_bson("{\"a\" : 1}")->data());
+    CLowlaDBBson::ptr sort = lowladb_json_to_bson("{\"a\" : 1}");
+    CLowlaDBBson::ptr explain = CLowlaDBCursor::create(other, nullptr)->sort(sort->data())->explain();
+    const char *path;
+    EXPECT_TRUE(explain->stringForKey("accessPath", &path));
+    EXPECT_STREQ("indexScan", path);
+    other->insert(lowladb_json_to_bson("{\"a\" : [0]}")->data());
+    explain = CLowlaDBCursor::create(other, nullptr)->sort(sort->data())->explain();
+    EXPECT_TRUE(explain->stringForKey("accessPath", &path));
+    EXPECT_STREQ("collectionScan", path);
+}
+
+TEST_F(DbTestFixture, test_cursor_explain) {
+    insertAB(coll, 1, 10);
+    insertAB(coll, 2, 20);
+    insertAB(coll, 2, 30);
+    
+    CLowlaDBBson::ptr query = CLowlaDBBson::create();
+    query->appendInt("a", 2);
+    query->finish();
+    
+    CLowlaDBBson::ptr explain = CLowlaDBCursor::create(coll, query->data())->explain();
+    const char *str;
+    int64_t val;
+    EXPECT_TRUE(explain->stringForKey("accessPath", &str));
+    EXPECT_STREQ("collectionScan", str);
+    EXPECT_TRUE(explain->stringForKey("sort", &str));
+    EXPECT_STREQ("none", str);
+    EXPECT_TRUE(explain->longForKey("entriesExamined", &val));
+    EXPECT_EQ(3, val);
+    EXPECT_TRUE(explain->longForKey("documentsExamined", &val));
+    EXPECT_EQ(3, val);
+    EXPECT_TRUE(explain->longForKey("documentsMatched", &val));
+    EXPECT_EQ(2, val);
+    EXPECT_TRUE(explain->longForKey("documentsReturned", &val));
+    EXPECT_EQ(2, val);
+    EXPECT_TRUE(explain->longForKey("bytesCopied", &val));
+    EXPECT_LT(0, val);
+    EXPECT_TRUE(explain->longForKey("micros", &val));
+    
+    CLowlaDBBson::ptr keys = CLowlaDBBson::create();
+    keys->appendInt("a", 1);
+    keys->finish();
+    coll->ensureIndex(keys->data());
+    
+    CLowlaDBBson::ptr sort = CLowlaDBBson::create();
+    sort->appendInt("a", 1);
+    sort->finish();
+    CLowlaDBCursor::ptr cursor = CLowlaDBCursor::create(coll, query->data())->sort(sort->data());
+    explain = cursor->explain();
+    EXPECT_TRUE(explain->stringForKey("accessPath", &str));
+    EXPECT_STREQ("indexScan", str);
+    EXPECT_TRUE(explain->stringForKey("sort", &str));
+    EXPECT_STREQ("index", str);
+    EXPECT_TRUE(explain->longForKey("documentsExamined", &val));
+    EXPECT_EQ(2, val);
+    
+    // Explaining doesn't consume the cursor
+    EXPECT_TRUE(!!cursor->next());
+    EXPECT_TRUE(!!cursor->next());
+    EXPECT_FALSE(cursor->next());
+}
+
+static std::vector<int> findBWhere(CLowlaDBCollection::ptr coll, const char *json) {
+    CLowlaDBBson::ptr query = lowladb_json_to_bson(json);
+    std::vector<int> answer;
+    CLowlaDBCursor::ptr cursor = CLowlaDBCursor::create(coll, query->data());
+    CLowlaDBBson::ptr doc = cursor->next();
+    while (doc) {
+        int val;
+        EXPECT_TRUE(doc->intForKey("b", &val));
+        answer.push_back(val);
+        doc = cursor->next();
+    }
+    std::sort(answer.begin(), answer.end());
+    return answer;
+}
+
+TEST_F(DbTestFixture, test_query_operators) {
+    for (int i = 1 ; i <= 5 ; ++i) {
+        insertAB(coll, i, i * 10);
+    }
+    CLowlaDBBson::ptr nested = lowladb_json_to_bson("{\"b\" : 60, \"c\" : {\"d\" : 7}}");
+    coll->insert(nested->data());
+    
+    EXPECT_EQ(std::vector<int>({40, 50}), findBWhere(coll, "{\"a\" : {\"$gt\" : 3}}"));
+    EXPECT_EQ(std::vector<int>({30, 40, 50}), findBWhere(coll, "{\"a\" : {\"$gte\" : 3}}"));
+    EXPECT_EQ(std::vector<int>({10}), findBWhere(coll, "{\"a\" : {\"$lt\" : 2}}"));
+    EXPECT_EQ(std::vector<int>({20, 30}), findBWhere(coll, "{\"a\" : {\"$gte\" : 2, \"$lte\" : 3}}"));
+    EXPECT_EQ(std::vector<int>({20, 30}), findBWhere(coll, "{\"a\" : {\"$gt\" : 1.5, \"$lt\" : 3.5}}"));
+    EXPECT_EQ(std::vector<int>({10, 20, 40, 50, 60}), findBWhere(coll, "{\"a\" : {\"$ne\" : 3}}"));
+    EXPECT_EQ(std::vector<int>({10, 50}), findBWhere(coll, "{\"a\" : {\"$in\" : [5, 1, 9]}}"));
+    EXPECT_EQ(std::vector<int>({20, 30, 40}), findBWhere(coll, "{\"a\" : {\"$nin\" : [5, 1]}, \"c\" : {\"$exists\" : false}}"));
+    EXPECT_EQ(std::vector<int>({60}), findBWhere(coll, "{\"a\" : null}"));
+    EXPECT_EQ(std::vector<int>({60}), findBWhere(coll, "{\"a\" : {\"$gte\" : null}}"));
+    EXPECT_EQ(std::vector<int>({60}), findBWhere(coll, "{\"a\" : {\"$lte\" : null}}"));
+    EXPECT_EQ(std::vector<int>(), findBWhere(coll, "{\"a\" : {\"$lt\" : null}}"));
+    EXPECT_EQ(std::vector<int>({60}), findBWhere(coll, "{\"c.d\" : 7}"));
+    EXPECT_EQ(std::vector<int>({60}), findBWhere(coll, "{\"c.d\" : {\"$exists\" : true}}"));
+    EXPECT_EQ(std::vector<int>({10, 20, 50}), findBWhere(coll, "{\"a\" : {\"$not\" : {\"$gte\" : 3, \"$lte\" : 4}}, \"b\" : {\"$lt\" : 60}}"));
+    EXPECT_EQ(std::vector<int>({10, 50}), findBWhere(coll, "{\"$or\" : [{\"a\" : 1}, {\"b\" : 50}]}"));
+    EXPECT_EQ(std::vector<int>({30}), findBWhere(coll, "{\"$and\" : [{\"a\" : {\"$gt\" : 2}}, {\"b\" : {\"$lt\" : 40}}]}"));
+    // Ranges don't cross types
+    EXPECT_EQ(std::vector<int>(), findBWhere(coll, "{\"a\" : {\"$gt\" : \"\"}}"));
+    
+    CLowlaDBBson::ptr query = lowladb_json_to_bson("{\"a\" : {\"$where\" : 1}}");
+    EXPECT_THROW(CLowlaDBCursor::create(coll, query->data())->next(), TeamstudioException);
+}
+
+TEST_F(DbTestFixture, test_query_exact_values) {
+    // Longs that only differ below double precision
+    CLowlaDBBson::ptr doc = CLowlaDBBson::create();
+    doc->appendLong("a", 9007199254740993LL);
+    doc->appendInt("b", 10);
+    doc->finish();
+    coll->insert(doc->data());
+    CLowlaDBBson::ptr query = CLowlaDBBson::create();
+    query->appendLong("a", 9007199254740992LL);
+    query->finish();
+    EXPECT_EQ(0, CLowlaDBCursor::create(coll, query->data())->count());
+    
+    // {a: Code("x"), b: 20}, which the json parser can't express
+    const char code[] = "\x15\x00\x00\x00" "\x0d" "a\x00" "\x02\x00\x00\x00" "x\x00" "\x10" "b\x00" "\x14\x00\x00\x00" "\x00";
+    coll->insert(code);
+    std::string otherCode(code, sizeof(code));
+    otherCode[11] = 'y';
+    EXPECT_EQ(1, CLowlaDBCursor::create(coll, code)->count());
+    EXPECT_EQ(0, CLowlaDBCursor::create(coll, otherCode.data())->count());
+}
+
+TEST_F(DbTestFixture, test_index_range_query) {
+    for (int i = 1 ; i <= 10 ; ++i) {
+        insertAB(coll, i % 2, i);
+    }
+    CLowlaDBBson::ptr keys = lowladb_json_to_bson("{\"a\" : 1, \"b\" : -1}");
+    coll->ensureIndex(keys->data());
+    
+    EXPECT_EQ(std::vector<int>({4, 6, 8}), findBWhere(coll, "{\"a\" : 0, \"b\" : {\"$gt\" : 2, \"$lte\" : 8}}"));
+    EXPECT_EQ(std::vector<int>({1, 3}), findBWhere(coll, "{\"a\" : 1, \"b\" : {\"$lt\" : 5}}"));
+    EXPECT_EQ(std::vector<int>({7, 9}), findBWhere(coll, "{\"a\" : 1, \"b\" : {\"$gte\" : 7}}"));
+    EXPECT_EQ(std::vector<int>({2, 3, 4}), findBWhere(coll, "{\"b\" : {\"$gte\" : 2, \"$lt\" : 5}}"));
+    
+    CLowlaDBBson::ptr query = lowladb_json_to_bson("{\"a\" : 0, \"b\" : {\"$gt\" : 2, \"$lte\" : 8}}");
+    CLowlaDBBson::ptr explain = CLowlaDBCursor::create(coll, query->data())->explain();
+    const char *str;
+    bool range;
+    int64_t val;
+    EXPECT_TRUE(explain->stringForKey("accessPath", &str));
+    EXPECT_STREQ("indexScan", str);
+    EXPECT_TRUE(explain->boolForKey("range", &range));
+    EXPECT_TRUE(range);
+    EXPECT_TRUE(explain->longForKey("documentsExamined", &val));
+    EXPECT_EQ(3, val);
+    
+    // A sort against the index walks the range backwards
+    CLowlaDBBson::ptr sort = lowladb_json_to_bson("{\"a\" : -1, \"b\" : 1}");
+    CLowlaDBCursor::ptr cursor = CLowlaDBCursor::create(coll, query->data())->sort(sort->data());
+    std::vector<int> found;
+    for (CLowlaDBBson::ptr doc = cursor->next() ; doc ; doc = cursor->next()) {
+        int b;
+        EXPECT_TRUE(doc->intForKey("b", &b));
+        found.push_back(b);
+    }
+    EXPECT_EQ(std::vector<int>({4, 6, 8}), found);
+}
+
+TEST_F(DbTestFixture, test_cursor_sort_limit_keeps_top_documents) {
+    // Ties on a keep the order the documents were inserted, as for an unlimited sort
+    for (int i = 0 ; i < 50 ; ++i) {
+        insertAB(coll, (i * 7) % 10, i);
+    }
+    CLowlaDBBson::ptr sort = lowladb_json_to_bson("{\"a\" : -1}");
+    std::vector<int> all;
+    CLowlaDBCursor::ptr cursor = CLowlaDBCursor::create(coll, nullptr)->sort(sort->data());
+    for (CLowlaDBBson::ptr doc = cursor->next() ; doc ; doc = cursor->next()) {
+        int val;
+        EXPECT_TRUE(doc->intForKey("b", &val));
+        all.push_back(val);
+    }
+    ASSERT_EQ(50, all.size());
+    
+    cursor = CLowlaDBCursor::create(coll, nullptr)->sort(sort->data())->skip(3)->limit(8);
+    std::vector<int> found;
+    for (CLowlaDBBson::ptr doc = cursor->next() ; doc ; doc = cursor->next()) {
+        int val;
+        EXPECT_TRUE(doc->intForKey("b", &val));
+        found.push_back(val);
+    }
+    EXPECT_EQ(std::vector<int>(all.begin() + 3, all.begin() + 11), found);
+    
+    CLowlaDBBson::ptr explain = cursor->explain();
+    const char *str;
+    EXPECT_TRUE(explain->stringForKey("sort", &str));
+    EXPECT_STREQ("topK", str);
+    
+    cursor = CLowlaDBCursor::create(coll, nullptr)->sort(sort->data())->skip(48)->limit(5);
+    EXPECT_EQ(2, cursor->count());
+    EXPECT_TRUE(!!cursor->next());
+    EXPECT_TRUE(!!cursor->next());
+    EXPECT_FALSE(cursor->next());
+    EXPECT_FALSE(CLowlaDBCursor::create(coll, nullptr)->sort(sort->data())->skip(60)->limit(5)->next());
+}
+
+TEST_F(DbTestFixture, test_cursor_sort_mixed_values) {
+    const char *values[] = {
+        "{\"a\" : \"abc\", \"b\" : 7}",
+        "{\"a\" : -2.5, \"b\" : 2}",
+        "{\"a\" : true, \"b\" : 9}",
+        "{\"b\" : 0}",
+        "{\"a\" : \"ab\", \"b\" : 6}",
+        "{\"a\" : 3, \"b\" : 4}",
+        "{\"a\" : {\"x\" : 1}, \"b\" : 8}",
+        "{\"a\" : -100, \"b\" : 1}",
+        "{\"a\" : 0, \"b\" : 3}",
+        "{\"a\" : \"\", \"b\" : 5}",
+    };
+    for (const char *value : values) {
+        CLowlaDBBson::ptr bson = lowladb_json_to_bson(value);
+        coll->insert(bson->data());
+    }
+    std::vector<int> expected({0, 1, 2, 3, 4, 5, 6, 7, 8, 9});
+    for (int direction : {1, -1}) {
+        CLowlaDBBson::ptr sort = CLowlaDBBson::create();
+        sort->appendInt("a", direction);
+        sort->finish();
+        for (int limit : {0, 4}) {
+            CLowlaDBCursor::ptr cursor = CLowlaDBCursor::create(coll, nullptr)->sort(sort->data())->limit(limit);
+            std::vector<int> found;
+            for (CLowlaDBBson::ptr doc = cursor->next() ; doc ; doc = cursor->next()) {
+                int val;
+                EXPECT_TRUE(doc->intForKey("b", &val));
+                found.push_back(val);
+            }
+            EXPECT_EQ(std::vector<int>(expected.begin(), 0 == limit ? expected.end() : expected.begin() + limit), found);
+        }
+        std::reverse(expected.begin(), expected.end());
+    }
+}
+
+TEST_F(DbTestFixture, test_cursor_sort_exact_longs) {
+    // 2^53 + 1 rounds to 2^53 as a double
+    CLowlaDBBson::ptr doc = CLowlaDBBson::create();
+    doc->appendLong("a", 9007199254740993LL);
+    doc->appendInt("b", 2);
+    doc->finish();
+    coll->insert(doc->data());
+    doc = CLowlaDBBson::create();
+    doc->appendLong("a", 9007199254740992LL);
+    doc->appendInt("b", 1);
+    doc->finish();
+    coll->insert(doc->data());
+    
+    for (int pass = 0 ; pass < 2 ; ++pass) {
+        if (1 == pass) {
+            coll->ensureIndex(lowladb_json_to_bson("{\"a\" : 1}")->data());
+        }
+        std::vector<int> expected({1, 2});
+        for (int direction : {1, -1}) {
+            CLowlaDBBson::ptr sort = CLowlaDBBson::create();
+            sort->appendInt("a", direction);
+            sort->finish();
+            CLowlaDBCursor::ptr cursor = CLowlaDBCursor::create(coll, nullptr)->sort(sort->data());
+            std::vector<int> found;
+            for (CLowlaDBBson::ptr doc = cursor->next() ; doc ; doc = cursor->next()) {
+                int val;
+                EXPECT_TRUE(doc->intForKey("b", &val));
+                found.push_back(val);
+            }
+            EXPECT_EQ(expected, found);
+            CLowlaDBBson::ptr explain = cursor->explain();
+            const char *path;
+            EXPECT_TRUE(explain->stringForKey("accessPath", &path));
+            EXPECT_STREQ(0 == pass ? "collectionScan" : "indexScan", path);
+            std::reverse(expected.begin(), expected.end());
+        }
+    }
+}
+
+TEST_F(DbTestFixture, test_cursor_sort_spills_to_disk) {
+    for (int i = 0 ; i < 200 ; ++i) {
+        insertAB(coll, (i * 37) % 20, i);
+    }
+    CLowlaDBBson::ptr sort = lowladb_json_to_bson("{\"a\" : 1}");
+    std::vector<int> expected;
+    CLowlaDBCursor::ptr cursor = CLowlaDBCursor::create(coll, nullptr)->sort(sort->data())->skip(5);
+    for (CLowlaDBBson::ptr doc = cursor->next() ; doc ; doc = cursor->next()) {
+        int val;
+        EXPECT_TRUE(doc->intForKey("b", &val));
+        expected.push_back(val);
+    }
+    ASSERT_EQ(195, expected.size());
+    
+    lowladb_set_sort_memory_budget(512);
+    cursor = CLowlaDBCursor::create(coll, nullptr)->sort(sort->data())->skip(5);
+    std::vector<int> found;
+    for (CLowlaDBBson::ptr doc = cursor->next() ; doc ; doc = cursor->next()) {
+        int val;
+        EXPECT_TRUE(doc->intForKey("b", &val));
+        found.push_back(val);
+    }
+    int runs;
+    EXPECT_TRUE(cursor->explain()->intForKey("sortRuns", &runs));
+    lowladb_set_sort_memory_budget(4 * 1024 * 1024);
+    EXPECT_EQ(expected, found);
+    EXPECT_LT(1, runs);
+    
+    // The temporary tables don't outlive the cursor
+    cursor.reset();
+    EXPECT_EQ(200, CLowlaDBCursor::create(coll, nullptr)->count());
+}
+
+TEST_F(DbTestFixture, test_cursor_sort_spills_long_keys) {
+    // Sort keys longer than a page, differing only past the first page
+    for (int i = 0 ; i < 20 ; ++i) {
+        CLowlaDBBson::ptr doc = CLowlaDBBson::create();
+        doc->appendString("a", (std::string(3000, 'x') + (char)('a' + (i * 7) % 20)).c_str());
+        doc->appendInt("b", i);
+        doc->finish();
+        coll->insert(doc->data());
+    }
+    CLowlaDBBson::ptr sort = lowladb_json_to_bson("{\"a\" : 1}");
+    std::vector<int> expected;
+    CLowlaDBCursor::ptr cursor = CLowlaDBCursor::create(coll, nullptr)->sort(sort->data());
+    for (CLowlaDBBson::ptr doc = cursor->next() ; doc ; doc = cursor->next()) {
+        int val;
+        EXPECT_TRUE(doc->intForKey("b", &val));
+        expected.push_back(val);
+    }
+    ASSERT_EQ(20, expected.size());
+    
+    lowladb_set_sort_memory_budget(8192);
+    cursor = CLowlaDBCursor::create(coll, nullptr)->sort(sort->data());
+    std::vector<int> found;
+    for (CLowlaDBBson::ptr doc = cursor->next() ; doc ; doc = cursor->next()) {
+        int val;
+        EXPECT_TRUE(doc->intForKey("b", &val));
+        found.push_back(val);
+    }
+    int runs;
+    EXPECT_TRUE(cursor->explain()->intForKey("sortRuns", &runs));
+    lowladb_set_sort_memory_budget(4 * 1024 * 1024);
+    EXPECT_EQ(expected, found);
+    EXPECT_LT(1, runs);
+}
+
+TEST_F(DbTestFixture, test_sort_spill_inside_another_transaction) {
+    for (int i = 0 ; i < 200 ; ++i) {
+        insertAB(coll, (i * 37) % 20, i);
+    }
+    // A started cursor holds the transaction that the sorting cursors then join
+    CLowlaDBCursor::ptr outer = CLowlaDBCursor::create(coll, nullptr);
+    ASSERT_TRUE(!!outer->next());
+    
+    CLowlaDBBson::ptr sort = lowladb_json_to_bson("{\"a\" : -1}");
+    lowladb_set_sort_memory_budget(512);
+    for (int pass = 0 ; pass < 2 ; ++pass) {
+        // The second pass reuses the tables the first could not drop while outer was open
+        CLowlaDBCursor::ptr cursor = CLowlaDBCursor::create(coll, nullptr)->sort(sort->data());
+        int count = 0;
+        int last = 100;
+        for (CLowlaDBBson::ptr doc = cursor->next() ; doc ; doc = cursor->next()) {
+            int val;
+            EXPECT_TRUE(doc->intForKey("a", &val));
+            EXPECT_GE(last, val);
+            last = val;
+            ++count;
+        }
+        EXPECT_EQ(200, count);
+    }
+    lowladb_set_sort_memory_budget(4 * 1024 * 1024);
+    
+    std::vector<utf16string> lstNames;
+    db->collectionNames(&lstNames);
+    EXPECT_EQ(std::vector<utf16string>({"mycoll"}), lstNames);
+}
+
+TEST_F(DbTestFixture, test_cursor_reads_documents_in_place) {
+    for (int i = 0 ; i < 20 ; ++i) {
+        insertAB(coll, i, i);
+    }
+    // Only the document that is returned gets copied
+    CLowlaDBBson::ptr query = lowladb_json_to_bson("{\"a\" : 3}");
+    int64_t copied;
+    EXPECT_TRUE(CLowlaDBCursor::create(coll, query->data())->explain()->longForKey("bytesCopied", &copied));
+    EXPECT_LT(0, copied);
+    EXPECT_GT(100, copied);
+    
+    // Documents on overflow pages are copied to be matched
+    CLowlaDBBson::ptr big = CLowlaDBBson::create();
+    big->appendInt("a", 100);
+    big->appendString("text", std::string(5000, 'x').c_str());
+    big->finish();
+    coll->insert(big->data());
+    
+    query = lowladb_json_to_bson("{\"a\" : {\"$gte\" : 19}}");
+    CLowlaDBCursor::ptr cursor = CLowlaDBCursor::create(coll, query->data());
+    CLowlaDBBson::ptr doc = cursor->next();
+    ASSERT_TRUE(!!doc);
+    int val;
+    EXPECT_TRUE(doc->intForKey("a", &val));
+    EXPECT_EQ(19, val);
+    doc = cursor->next();
+    ASSERT_TRUE(!!doc);
+    const char *text;
+    EXPECT_TRUE(doc->stringForKey("text", &text));
+    EXPECT_EQ(5000, strlen(text));
+    EXPECT_FALSE(cursor->next());
+}
+
+TEST_F(DbTestFixture, test_cursor_scans_overflow_documents_of_varying_size) {
+    const int sizes[] = { 3000, 8000, 1500, 6000, 2000 };
+    for (int i = 0 ; i < 5 ; ++i) {
+        CLowlaDBBson::ptr bson = CLowlaDBBson::create();
+        bson->appendInt("a", i % 2);
+        bson->appendString("text", std::string(sizes[i], 'a' + i).c_str());
+        bson->finish();
+        coll->insert(bson->data());
+    }
+    CLowlaDBBson::ptr query = lowladb_json_to_bson("{\"a\" : 0}");
+    EXPECT_EQ(3, CLowlaDBCursor::create(coll, query->data())->count());
+    
+    CLowlaDBCursor::ptr cursor = CLowlaDBCursor::create(coll, query->data());
+    for (int i = 0 ; i < 5 ; i += 2) {
+        CLowlaDBBson::ptr doc = cursor->next();
+        ASSERT_TRUE(!!doc);
+        const char *text;
+        EXPECT_TRUE(doc->stringForKey("text", &text));
+        EXPECT_EQ(std::string(sizes[i], 'a' + i), text);
+    }
+    EXPECT_FALSE(cursor->next());
+}
+
+TEST_F(DbTestFixture, test_cursor_next_batch) {
+    for (int i = 0 ; i < 7 ; ++i) {
+        insertAB(coll, 7 - i, i);
+    }
+    CLowlaDBBson::ptr sort = lowladb_json_to_bson("{\"a\" : 1}");
+    CLowlaDBCursor::ptr cursor = CLowlaDBCursor::create(coll, nullptr)->sort(sort->data());
+    std::vector<char> buffer;
+    std::vector<size_t> offsets;
+    std::vector<int> found;
+    std::vector<size_t> batchSizes;
+    size_t count;
+    while (0 != (count = cursor->nextBatch(3, &buffer, &offsets))) {
+        batchSizes.push_back(count);
+        EXPECT_EQ(count, offsets.size());
+        for (size_t offset : offsets) {
+            CLowlaDBBson::ptr doc = CLowlaDBBson::create(&buffer[offset], false);
+            int val;
+            EXPECT_TRUE(doc->intForKey("b", &val));
+            found.push_back(val);
+        }
+    }
+    EXPECT_EQ(std::vector<size_t>({3, 3, 1}), batchSizes);
+    EXPECT_EQ(std::vector<int>({6, 5, 4, 3, 2, 1, 0}), found);
+    
+    // Batches pick up where next() left off
+    cursor = CLowlaDBCursor::create(coll, nullptr)->showPending();
+    EXPECT_TRUE(!!cursor->next());
+    EXPECT_EQ(6, cursor->nextBatch(10, &buffer, &offsets));
+    bool pending;
+    EXPECT_TRUE(CLowlaDBBson::create(&buffer[offsets[5]], false)->boolForKey("$pending", &pending));
+    EXPECT_TRUE(pending);
+}
+
+static bool collectB(void *user, const char *bson, size_t size) {
+    std::vector<int> *found = (std::vector<int> *)user;
+    CLowlaDBBson::ptr doc = CLowlaDBBson::create(bson, false);
+    EXPECT_EQ(size, doc->size());
+    int val;
+    EXPECT_TRUE(doc->intForKey("b", &val));
+    found->push_back(val);
+    return found->size() < 4;
+}
+
+TEST_F(DbTestFixture, test_cursor_for_each) {
+    for (int i = 0 ; i < 6 ; ++i) {
+        insertAB(coll, i % 3, i);
+    }
+    CLowlaDBBson::ptr query = lowladb_json_to_bson("{\"a\" : {\"$gt\" : 0}}");
+    std::vector<int> found;
+    EXPECT_EQ(4, CLowlaDBCursor::create(coll, query->data())->forEach(collectB, &found));
+    EXPECT_EQ(std::vector<int>({1, 2, 4, 5}), found);
+    
+    // The callback stops the traversal once it has four documents
+    found.clear();
+    CLowlaDBBson::ptr sort = lowladb_json_to_bson("{\"b\" : -1}");
+    EXPECT_EQ(4, CLowlaDBCursor::create(coll, nullptr)->sort(sort->data())->forEach(collectB, &found));
+    EXPECT_EQ(std::vector<int>({5, 4, 3, 2}), found);
+}
+
+TEST_F(DbTestFixture, test_cursor_projection) {
+    CLowlaDBBson::ptr doc = lowladb_json_to_bson("{\"a\" : 1, \"b\" : {\"c\" : 2, \"d\" : 3}, \"e\" : [{\"f\" : 4, \"g\" : 5}, 6], \"h\" : \"text\"}");
+    coll->insert(doc->data());
+    
+    CLowlaDBBson::ptr keys = lowladb_json_to_bson("{\"a\" : 1, \"b.c\" : 1, \"e.f\" : 1}");
+    CLowlaDBBson::ptr found = CLowlaDBCursor::create(coll, nullptr, keys->data())->next();
+    int val;
+    CLowlaDBBson::ptr sub;
+    EXPECT_TRUE(found->containsKey("_id"));
+    EXPECT_TRUE(found->intForKey("a", &val));
+    EXPECT_TRUE(found->objectForKey("b", &sub));
+    EXPECT_TRUE(sub->intForKey("c", &val));
+    EXPECT_EQ(2, val);
+    EXPECT_FALSE(sub->containsKey("d"));
+    EXPECT_TRUE(found->arrayForKey("e", &sub));
+    CLowlaDBBson::ptr element;
+    EXPECT_TRUE(sub->objectForKey("0", &element));
+    EXPECT_TRUE(element->intForKey("f", &val));
+    EXPECT_EQ(4, val);
+    EXPECT_FALSE(element->containsKey("g"));
+    EXPECT_FALSE(sub->containsKey("1"));
+    EXPECT_FALSE(found->containsKey("h"));
+    
+    keys = lowladb_json_to_bson("{\"h\" : 1, \"_id\" : 0}");
+    found = CLowlaDBCursor::create(coll, nullptr, keys->data())->next();
+    EXPECT_FALSE(found->containsKey("_id"));
+    EXPECT_FALSE(found->containsKey("a"));
+    EXPECT_TRUE(found->containsKey("h"));
+    
+    keys = lowladb_json_to_bson("{\"b.d\" : 0, \"e.g\" : 0, \"h\" : 0}");
+    found = CLowlaDBCursor::create(coll, nullptr, keys->data())->next();
+    EXPECT_TRUE(found->containsKey("_id"));
+    EXPECT_TRUE(found->intForKey("a", &val));
+    EXPECT_TRUE(found->objectForKey("b", &sub));
+    EXPECT_TRUE(sub->containsKey("c"));
+    EXPECT_FALSE(sub->containsKey("d"));
+    EXPECT_TRUE(found->arrayForKey("e", &sub));
+    EXPECT_TRUE(sub->objectForKey("0", &element));
+    EXPECT_TRUE(element->containsKey("f"));
+    EXPECT_FALSE(element->containsKey("g"));
+    EXPECT_TRUE(sub->intForKey("1", &val));
+    EXPECT_EQ(6, val);
+    EXPECT_FALSE(found->containsKey("h"));
+}
+
+TEST_F(DbTestFixture, test_cursor_projection_with_batches) {
+    for (int i = 0 ; i < 6 ; ++i) {
+        insertAB(coll, i % 3, i);
+    }
+    CLowlaDBBson::ptr keys = lowladb_json_to_bson("{\"b\" : 1, \"_id\" : 0}");
+    std::vector<int> found;
+    EXPECT_EQ(4, CLowlaDBCursor::create(coll, nullptr, keys->data())->forEach(collectB, &found));
+    EXPECT_EQ(std::vector<int>({0, 1, 2, 3}), found);
+    
+    std::vector<char> buffer;
+    std::vector<size_t> offsets;
+    EXPECT_EQ(6, CLowlaDBCursor::create(coll, nullptr, keys->data())->nextBatch(10, &buffer, &offsets));
+    CLowlaDBBson::ptr doc = CLowlaDBBson::create(&buffer[offsets[2]], false);
+    EXPECT_FALSE(doc->containsKey("a"));
+    EXPECT_FALSE(doc->containsKey("_id"));
+    EXPECT_TRUE(doc->containsKey("b"));
+    
+    keys = lowladb_json_to_bson("{\"a\" : 1, \"b\" : 0}");
+    try {
+        CLowlaDBCursor::create(coll, nullptr, keys->data())->next();
+        FAIL();
+    }
+    catch (TeamstudioException const &e) {
+        EXPECT_TRUE(nullptr != strstr(e.what(), "mix"));
+    }
+}
+
+TEST_F(DbTestFixture, test_bson_repeated_key_lookup) {
+    CLowlaDBBson::ptr bson = CLowlaDBBson::create();
+    char key[16];
+    for (int i = 0 ; i < 50 ; ++i) {
+        sprintf(key, "field%d", i);
+        bson->appendInt(key, i);
+    }
+    bson->appendString("field7", "duplicate");
+    bson->appendString("name", "value");
+    bson->finish();
+    
+    // Every lookup after the first is answered from the field table
+    for (int pass = 0 ; pass < 2 ; ++pass) {
+        for (int i = 0 ; i < 50 ; ++i) {
+            sprintf(key, "field%d", i);
+            int val;
+            EXPECT_TRUE(bson->intForKey(key, &val));
+            EXPECT_EQ(i, val);
+        }
+    }
+    const char *str;
+    EXPECT_TRUE(bson->stringForKey("name", &str));
+    EXPECT_STREQ("value", str);
+    EXPECT_FALSE(bson->stringForKey("field7", &str));
+    EXPECT_FALSE(bson->containsKey("field50"));
+    EXPECT_FALSE(bson->containsKey(""));
+    
+    CLowlaDBBson::ptr other = CLowlaDBBson::create();
+    other->appendInt("x", 12);
+    other->finish();
+    EXPECT_TRUE(bson->equalValues("field12", other, "x"));
+    EXPECT_FALSE(bson->equalValues("field13", other, "x"));
+    EXPECT_FALSE(bson->equalValues("missing", other, "x"));
+}
+
+// The first document in the collection as json (which lists fields by name) without _id or whitespace
+static std::string firstDocumentJson(CLowlaDBCollection::ptr coll) {
+    CLowlaDBBson::ptr keys = lowladb_json_to_bson("{\"_id\" : 0}");
+    CLowlaDBBson::ptr doc = CLowlaDBCursor::create(coll, nullptr, keys->data())->next();
+    std::string json(lowladb_bson_to_json(doc->data()).c_str());
+    json.erase(std::remove_if(json.begin(), json.end(), isspace), json.end());
+    return json;
+}
+
+TEST_F(DbTestFixture, test_update_dotted_paths) {
+    CLowlaDBBson::ptr doc = lowladb_json_to_bson("{\"a\" : {\"b\" : 1, \"c\" : 2}, \"d\" : [1, 2], \"e\" : 3}");
+    coll->insert(doc->data());
+    
+    CLowlaDBBson::ptr update = lowladb_json_to_bson("{\"$set\" : {\"a.b\" : 10, \"x.y.z\" : 4, \"d.3\" : 5}, \"$unset\" : {\"a.c\" : 1, \"e\" : 1, \"d.0\" : 1}}");
+    coll->update(CLowlaDBBson::empty()->data(), update->data(), false, false);
+    EXPECT_EQ("{\"a\":{\"b\":10},\"d\":[null,2,null,5],\"x\":{\"y\":{\"z\":4}}}", firstDocumentJson(coll));
+    
+    // Paths can't descend into scalars or overlap
+    update = lowladb_json_to_bson("{\"$set\" : {\"a.b.c\" : 1}}");
+    try {
+        coll->update(CLowlaDBBson::empty()->data(), update->data(), false, false);
+        FAIL();
+    }
+    catch (TeamstudioException const &e) {
+        EXPECT_TRUE(nullptr != strstr(e.what(), "non-object"));
+    }
+    update = lowladb_json_to_bson("{\"$set\" : {\"a\" : 1}, \"$unset\" : {\"a.b\" : 1}}");
+    try {
+        coll->update(CLowlaDBBson::empty()->data(), update->data(), false, false);
+        FAIL();
+    }
+    catch (TeamstudioException const &e) {
+        EXPECT_TRUE(nullptr != strstr(e.what(), "conflict"));
+    }
+    EXPECT_EQ("{\"a\":{\"b\":10},\"d\":[null,2,null,5],\"x\":{\"y\":{\"z\":4}}}", firstDocumentJson(coll));
+}
+
+TEST_F(DbTestFixture, test_update_multi_wide_documents) {
+    CLowlaDBBson::ptr set = CLowlaDBBson::create();
+    for (int i = 0 ; i < 10 ; ++i) {
+        CLowlaDBBson::ptr doc = CLowlaDBBson::create();
+        char key[16];
+        for (int j = 0 ; j < 100 ; ++j) {
+            sprintf(key, "f%d", j);
+            doc->appendInt(key, i);
+        }
+        doc->finish();
+        coll->insert(doc->data());
+    }
+    set->appendInt("f50", -1);
+    set->appendInt("g", -2);
+    set->finish();
+    CLowlaDBBson::ptr update = CLowlaDBBson::create();
+    update->appendObject("$set", set->data());
+    update->finish();
+    CLowlaDBWriteResult::ptr wr = coll->update(CLowlaDBBson::empty()->data(), update->data(), false, true);
+    EXPECT_EQ(10, wr->documentCount());
+    
+    CLowlaDBCursor::ptr cursor = CLowlaDBCursor::create(coll, nullptr);
+    for (CLowlaDBBson::ptr doc = cursor->next() ; doc ; doc = cursor->next()) {
+        int val;
+        EXPECT_TRUE(doc->intForKey("f50", &val));
+        EXPECT_EQ(-1, val);
+        EXPECT_TRUE(doc->intForKey("g", &val));
+        EXPECT_EQ(-2, val);
+        EXPECT_TRUE(doc->intForKey("f99", &val));
+    }
+}
+
+TEST_F(DbTestFixture, test_update_operators) {
+    CLowlaDBBson::ptr doc = lowladb_json_to_bson("{\"n\" : 5, \"m\" : 2147483647, \"lo\" : 3, \"hi\" : 3, \"tags\" : [\"a\", \"b\", \"a\"], \"old\" : {\"x\" : 1}}");
+    coll->insert(doc->data());
+    
+    CLowlaDBBson::ptr update = lowladb_json_to_bson("{\"$inc\" : {\"n\" : 2, \"m\" : 1, \"c.d\" : 1}, \"$mul\" : {\"z\" : 3}, \"$min\" : {\"lo\" : 1}, \"$max\" : {\"hi\" : 1}, \"$pull\" : {\"tags\" : \"a\"}, \"$push\" : {\"list\" : {\"$each\" : [1, 2]}}, \"$addToSet\" : {\"set\" : 1}, \"$rename\" : {\"old.x\" : \"renamed\"}}");
+    coll->update(CLowlaDBBson::empty()->data(), update->data(), false, false);
+    EXPECT_EQ("{\"c\":{\"d\":1},\"hi\":3,\"list\":[1,2],\"lo\":1,\"m\":2147483648,\"n\":7,\"old\":null,\"renamed\":1,\"set\":[1],\"tags\":[\"b\"],\"z\":0}", firstDocumentJson(coll));
+    
+    update = lowladb_json_to_bson("{\"$push\" : {\"tags\" : \"c\"}, \"$addToSet\" : {\"set\" : {\"$each\" : [1, 3]}}, \"$rename\" : {\"missing\" : \"other\"}}");
+    coll->update(CLowlaDBBson::empty()->data(), update->data(), false, false);
+    EXPECT_EQ("{\"c\":{\"d\":1},\"hi\":3,\"list\":[1,2],\"lo\":1,\"m\":2147483648,\"n\":7,\"old\":null,\"renamed\":1,\"set\":[1,3],\"tags\":[\"b\",\"c\"],\"z\":0}", firstDocumentJson(coll));
+    
+    update = lowladb_json_to_bson("{\"$inc\" : {\"tags\" : 1}}");
+    try {
+        coll->update(CLowlaDBBson::empty()->data(), update->data(), false, false);
+        FAIL();
+    }
+    catch (TeamstudioException const &e) {
+        EXPECT_TRUE(nullptr != strstr(e.what(), "non-numeric"));
+    }
+}
+
+TEST_F(DbTestFixture, test_update_fixed_size_fields_in_place) {
+    CLowlaDBBson::ptr big = CLowlaDBBson::create();
+    big->appendInt("views", 1);
+    big->appendString("text", std::string(5000, 'x').c_str());
+    big->appendDouble("score", 1.5);
+    big->appendBool("seen", false);
+    big->finish();
+    coll->insert(big->data());
+    insertAB(coll, 1, 2);
+    coll->ensureIndex(lowladb_json_to_bson("{\"views\" : 1}")->data());
+    
+    CLowlaDBBson::ptr update = lowladb_json_to_bson("{\"$inc\" : {\"views\" : 1}, \"$set\" : {\"score\" : 2.5, \"seen\" : true}}");
+    CLowlaDBBson::ptr query = lowladb_json_to_bson("{\"views\" : {\"$exists\" : true}}");
+    for (int i = 0 ; i < 3 ; ++i) {
+        coll->update(query->data(), update->data(), false, false);
+    }
+    
+    // The index follows the patched value and the other fields are untouched
+    CLowlaDBBson::ptr found = CLowlaDBCursor::create(coll, lowladb_json_to_bson("{\"views\" : 4}")->data())->next();
+    ASSERT_TRUE(nullptr != found);
+    double score;
+    EXPECT_TRUE(found->doubleForKey("score", &score));
+    EXPECT_EQ(2.5, score);
+    bool seen;
+    EXPECT_TRUE(found->boolForKey("seen", &seen));
+    EXPECT_TRUE(seen);
+    const char *text;
+    EXPECT_TRUE(found->stringForKey("text", &text));
+    EXPECT_EQ(std::string(5000, 'x'), text);
+    EXPECT_EQ(0, CLowlaDBCursor::create(coll, lowladb_json_to_bson("{\"views\" : 3}")->data())->count());
+    EXPECT_EQ(2, CLowlaDBCursor::create(coll, nullptr)->count());
+    
+    // Changing the size of the document still rewrites it
+    update = lowladb_json_to_bson("{\"$set\" : {\"views\" : \"many\"}}");
+    coll->update(query->data(), update->data(), false, false);
+    EXPECT_EQ(1, CLowlaDBCursor::create(coll, lowladb_json_to_bson("{\"views\" : \"many\"}")->data())->count());
+}
+
+TEST_F(DbTestFixture, test_find_and_modify) {
+    for (int i = 0 ; i < 4 ; ++i) {
+        insertAB(coll, i % 2, i);
+    }
+    CLowlaDBBson::ptr query = lowladb_json_to_bson("{\"a\" : 1}");
+    CLowlaDBBson::ptr update = lowladb_json_to_bson("{\"$inc\" : {\"b\" : 10}}");
+    CLowlaDBBson::ptr sort = lowladb_json_to_bson("{\"b\" : -1}");
+    
+    // The highest b with a == 1 is 3, and the old image is returned by default
+    CLowlaDBBson::ptr doc = coll->findAndModify(query->data(), update->data(), sort->data(), false, false, false);
+    int val;
+    EXPECT_TRUE(doc->intForKey("b", &val));
+    EXPECT_EQ(3, val);
+    doc = coll->findAndModify(query->data(), update->data(), sort->data(), true, false, false);
+    EXPECT_TRUE(doc->intForKey("b", &val));
+    EXPECT_EQ(23, val);
+    EXPECT_EQ(std::vector<int>({0, 1, 2, 23}), findBWhere(coll, "{}"));
+    
+    doc = coll->findAndModify(query->data(), nullptr, nullptr, false, false, true);
+    EXPECT_TRUE(doc->intForKey("b", &val));
+    EXPECT_EQ(1, val);
+    EXPECT_EQ(std::vector<int>({0, 2, 23}), findBWhere(coll, "{}"));
+    
+    query = lowladb_json_to_bson("{\"a\" : 7}");
+    EXPECT_FALSE(coll->findAndModify(query->data(), update->data(), nullptr, true, false, false));
+    doc = coll->findAndModify(query->data(), update->data(), nullptr, true, true, false);
+    EXPECT_TRUE(doc->containsKey("_id"));
+    EXPECT_TRUE(doc->intForKey("a", &val));
+    EXPECT_EQ(7, val);
+    EXPECT_TRUE(doc->intForKey("b", &val));
+    EXPECT_EQ(10, val);
+    EXPECT_EQ(1, CLowlaDBCursor::create(coll, query->data())->count());
+    
+    // Dotted query fields become nested fields of the upserted document
+    query = lowladb_json_to_bson("{\"_id\" : \"x\", \"c.d\" : 5}");
+    doc = coll->findAndModify(query->data(), update->data(), nullptr, true, true, false);
+    CLowlaDBBson::ptr sub;
+    ASSERT_TRUE(doc->objectForKey("c", &sub));
+    EXPECT_TRUE(sub->intForKey("d", &val));
+    EXPECT_EQ(5, val);
+    EXPECT_FALSE(doc->containsKey("c.d"));
+    EXPECT_EQ(1, CLowlaDBCursor::create(coll, query->data())->count());
+}
+
+TEST_F(DbTestFixture, test_remove_while_scanning) {
+    coll->ensureIndex(lowladb_json_to_bson("{\"a\" : 1}")->data());
+    for (int i = 0 ; i < 300 ; ++i) {
+        insertAB(coll, i % 3, i);
+    }
+    // Remove the first and last documents along with some in between
+    CLowlaDBWriteResult::ptr wr = coll->remove(lowladb_json_to_bson("{\"b\" : {\"$in\" : [0, 3, 6, 297, 299]}}")->data());
+    EXPECT_EQ(5, wr->documentCount());
+    wr = coll->remove(lowladb_json_to_bson("{\"a\" : 0}")->data());
+    EXPECT_EQ(96, wr->documentCount());
+    EXPECT_EQ(199, CLowlaDBCursor::create(coll, nullptr)->count());
+    EXPECT_EQ(0, CLowlaDBCursor::create(coll, lowladb_json_to_bson("{\"a\" : 0}")->data())->count());
+    EXPECT_EQ(100, CLowlaDBCursor::create(coll, lowladb_json_to_bson("{\"a\" : 1}")->data())->count());
+    
+    wr = coll->remove(nullptr);
+    EXPECT_EQ(199, wr->documentCount());
+    EXPECT_EQ(0, CLowlaDBCursor::create(coll, nullptr)->count());
+}
+
 static void TestCollectionListener(void *user, const char *ns);
 
 class ListenerTestFixture : public DbTestFixture
@@ -1523,6 +2668,35 @@ TEST_F(DbTestFixture, test_compute_push_payload_for_removed_document) {
     EXPECT_TRUE(pd->isComplete());
 }
 
+TEST_F(DbTestFixture, test_compute_push_payload_for_truncated_collection) {
+    pullTestDocument();
+    coll->ensureIndex(lowladb_json_to_bson("{\"myfield\" : 1}")->data());
+    
+    CLowlaDBWriteResult::ptr wr = coll->remove(nullptr);
+    EXPECT_EQ(1, wr->documentCount());
+    EXPECT_EQ(0, CLowlaDBCursor::create(coll, nullptr)->count());
+    EXPECT_EQ(0, CLowlaDBCursor::create(coll, lowladb_json_to_bson("{\"myfield\" : \"mystring\"}")->data())->count());
+
+    CLowlaDBPushData::ptr pd = lowladb_collect_push_data();
+    CLowlaDBBson::ptr push = lowladb_create_push_request(pd);
+    CLowlaDBBson::ptr arr;
+    EXPECT_TRUE(push->arrayForKey("documents", &arr));
+    CLowlaDBBson::ptr obj;
+    EXPECT_TRUE(arr->objectForKey("0", &obj));
+    CLowlaDBBson::ptr subObj;
+    EXPECT_TRUE(obj->objectForKey("_lowla", &subObj));
+    const char *check;
+    EXPECT_TRUE(subObj->stringForKey("id", &check));
+    EXPECT_STREQ("serverdb.servercoll$1234", check);
+    bool checkDeleted;
+    EXPECT_TRUE(subObj->boolForKey("deleted", &checkDeleted));
+    EXPECT_TRUE(checkDeleted);
+    
+    // The collection can be filled again afterwards
+    insertAB(coll, 1, 2);
+    EXPECT_EQ(1, CLowlaDBCursor::create(coll, nullptr)->count());
+}
+
 TEST_F(DbTestFixture, test_push_response_that_edits_document) {
     CLowlaDBBson::ptr doc = CLowlaDBBson::create();
     doc->appendString("_id", "1");